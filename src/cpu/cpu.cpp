@@ -10,8 +10,21 @@ namespace cpu {
     
     const usize stack_size = 0x10000; // 64 KiB
 
+    static u64 online_cpu_mask = 0;
+    static u32 lapic_ids[max_cpus];
+
+    u64 online_cpus() {
+        return __atomic_load_n(&online_cpu_mask, __ATOMIC_SEQ_CST);
+    }
+
+    u32 lapic_id(usize cpu) {
+        return lapic_ids[cpu];
+    }
+
     void smp_init(limine_smp_response *smp_res) {
         klib::printf("CPU: SMP | x2APIC: %s\n", (smp_res->flags & 1) ? "yes" : "no");
+        if (smp_res->cpu_count > max_cpus)
+            panic("Too many CPUs (%ld), at most %ld are supported", smp_res->cpu_count, max_cpus);
         for (u32 i = 0; i < smp_res->cpu_count; i++) {
             auto cpu_info = smp_res->cpus[i];
             auto is_bsp = cpu_info->lapic_id == smp_res->bsp_lapic_id;
@@ -31,6 +44,8 @@ namespace cpu {
     }
 
     void early_init() {
+        write_gs_base(0); // no task is running yet, see current_cpu_number()
+        write_cr0(read_cr0() | (1 << 16)); // write protect, the kernel must fault on read only pages too
         load_gdt();
         interrupts::load_idt();
 
@@ -43,7 +58,8 @@ namespace cpu {
         reload_gdt();
         interrupts::load_idt();
 
-        mem::vmm::get_kernel_pagemap()->activate();
+        write_cr0(read_cr0() | (1 << 16)); // write protect
+        mem::vmm::init_cpu();
 
         auto cpu_local = (Local*)info->extra_argument;
         cpu_local->lapic_id = info->lapic_id;
@@ -70,9 +86,13 @@ namespace cpu {
         MSR::write(MSR::IA32_STAR, star);
         MSR::write(MSR::IA32_LSTAR, (u64)&__syscall_entry);
 
-        if (!cpu_local->is_bsp) {
+        if (!cpu_local->is_bsp) { // halted with interrupts off, so they never count as online
             asm("cli");
             while (true) asm("hlt");
         }
+
+        // indexed like current_cpu_number(), tasks only run on the bsp and report cpu 0 there
+        lapic_ids[current_cpu_number()] = info->lapic_id;
+        __atomic_or_fetch(&online_cpu_mask, (u64)1 << current_cpu_number(), __ATOMIC_SEQ_CST);
     }
 }
@@ -5,10 +5,15 @@
 #include <panic.hpp>
 
 namespace cpu {
+    constexpr usize max_cpus = 64;
+
     void early_init();
     void smp_init(limine_smp_response *smp_res);
     void init(limine_smp_info *info);
 
+    u64 online_cpus(); // mask of the cpus that take interrupts
+    u32 lapic_id(usize cpu);
+
     struct [[gnu::packed]] TSS {
         u32 reserved0;
         u64 rsp0, rsp1, rsp2;
@@ -65,6 +70,10 @@ namespace cpu {
         asm volatile("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (leaf), "c" (subleaf));
     }
     
+    static inline void write_cr0(u64 cr0) {
+        asm volatile("mov %0, %%cr0" : : "r" (cr0));
+    }
+
     static inline void write_cr3(u64 cr3) {
         asm volatile("mov %0, %%cr3" : : "r" (cr3));
     }
@@ -73,6 +82,12 @@ namespace cpu {
         asm volatile("mov %0, %%cr4" : : "r" (cr4));
     }
 
+    static inline u64 read_cr0() {
+        volatile u64 cr0;
+        asm volatile("mov %%cr0, %0" : "=r" (cr0));
+        return cr0;
+    }
+
     static inline u64 read_cr2() {
         volatile u64 cr2;
         asm volatile("mov %%cr2, %0" : "=r" (cr2));
@@ -115,9 +130,32 @@ namespace cpu {
         return MSR::read(MSR::IA32_FS_BASE);
     }
 
+    // inside the kernel the gs base points to the running task, whose first field is the cpu it runs on
+    static inline usize current_cpu_number() {
+        u64 gs_base = read_gs_base();
+        return gs_base ? *(usize*)gs_base : 0; // no task is running yet during early boot
+    }
+
+    // also drops global entries and the entries of every pcid
+    static inline void flush_tlb_all() {
+        u64 cr4 = read_cr4();
+        if (cr4 & (1 << 7)) { // toggling PGE flushes everything
+            write_cr4(cr4 & ~(u64)(1 << 7));
+            write_cr4(cr4);
+        } else {
+            write_cr3(read_cr3());
+        }
+    }
+
     static inline void invlpg(void *m) {
         asm volatile("invlpg (%0)" : : "r" (m) : "memory");
     }
+
+    // invalidates the translation of address tagged with pcid, which doesnt have to be the loaded one
+    static inline void invpcid_address(u16 pcid, uptr address) {
+        struct { u64 pcid, address; } descriptor = { pcid, address };
+        asm volatile("invpcid %0, %1" : : "m" (descriptor), "r" ((u64)0) : "memory");
+    }
     
     template<klib::Integral T> 
     static inline T bswap(T val) {
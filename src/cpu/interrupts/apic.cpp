@@ -41,6 +41,12 @@ namespace cpu::interrupts {
         write_reg(EOI, 0);
     }
 
+    void LAPIC::send_ipi(u32 lapic_id, u8 vector) {
+        while (read_reg(ICR) & (1 << 12)); // wait until the previous ipi was delivered
+        write_reg(ICR_HIGH, lapic_id << 24);
+        write_reg(ICR, vector); // fixed delivery to the physical destination, writing the low half sends it
+    }
+
     void LAPIC::set_vector(R reg, u8 vector, bool nmi, bool active_low, bool level_trigger, bool mask) {
         write_reg(reg, vector | (nmi << 10) | (active_low << 13) | (level_trigger << 15) | (mask << 16));
     }
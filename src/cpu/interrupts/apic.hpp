@@ -10,6 +10,7 @@ namespace cpu::interrupts {
             EOI = 0xB0,
             SPURIOUS = 0xF0,
             ICR = 0x300,
+            ICR_HIGH = 0x310,
             LVT_CMCI = 0x2F0,
             LVT_TIMER = 0x320,
             LVT_THERMAL = 0x330,
@@ -32,6 +33,7 @@ namespace cpu::interrupts {
 
         static u32 read_id();
         static void eoi();
+        static void send_ipi(u32 lapic_id, u8 vector);
 
         static void set_vector(R reg, u8 vector, bool nmi, bool active_low, bool level_trigger, bool mask);
         static void mask_vector(R reg);
@@ -11,19 +11,17 @@ namespace cpu::interrupts {
     [[gnu::aligned(16)]] static IDTEntry idt[256];
     static IDTR idtr;
     static IDTHandler idt_handlers[256];
-    static u8 idt_raw_bitmap[256 / 8];
+    static u64 idt_raw_bitmap[256 / 64];
     static klib::Bitmap idt_bitmap;
 
     extern "C" void (*__idt_wrappers[256])();
 
     u8 allocate_vector() {
-        for (u8 i = 32; i; i++) {
-            if (idt_bitmap.get(i) == false) {
-                idt_bitmap.set(i, true);
-                return i;
-            }
-        }
-        panic("Failed to allocate interrupt");
+        usize i = idt_bitmap.find_first_clear(32);
+        if (i >= idt_bitmap.m_size)
+            panic("Failed to allocate interrupt");
+        idt_bitmap.set(i, true);
+        return i;
     }
 
     void load_idt_entry(u8 index, void (*wrapper)(), IDTType type) {
@@ -95,12 +93,12 @@ namespace cpu::interrupts {
 
     static void page_fault_handler(u64 vec, InterruptState *state) {
         u64 cr2 = cpu::read_cr2();
-        mem::vmm::Pagemap *pagemap;
-        if ((state->cs & 3) == 3)
-            pagemap = ((sched::Task*)cpu::read_gs_base())->pagemap;
-        else
-            pagemap = mem::vmm::get_kernel_pagemap();
-        if (pagemap->handle_page_fault(cr2))
+        mem::vmm::Pagemap *pagemap = mem::vmm::get_kernel_pagemap();
+        // the kernel faults on user memory too, e.g. when a syscall writes into a copy on write buffer
+        auto *task = (sched::Task*)cpu::read_gs_base();
+        if (cr2 < mem::vmm::user_half_end && task)
+            pagemap = task->pagemap;
+        if (pagemap->handle_page_fault(cr2, state->err))
             exception_handler(vec, state);
         // else
         //     klib::printf("Demand paged %#lX\n", cr2);
@@ -117,10 +115,9 @@ namespace cpu::interrupts {
         for (int i = 0; i < 256; i++)
             load_idt_entry(i, __idt_wrappers[i], IDTType::INTERRUPT);
         
-        for (int i = 0; i < 32; i++) {
+        for (int i = 0; i < 32; i++)
             load_idt_handler(i, i == 0xE ? page_fault_handler : exception_handler);
-            idt_bitmap.set(i, true);
-        }
+        idt_bitmap.set_range(0, 32, true);
 
         idtr.limit = sizeof(idt) - 1;
         idtr.base = (u64)&idt;
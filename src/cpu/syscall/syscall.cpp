@@ -5,7 +5,7 @@
 #include <fs/vfs.hpp>
 
 namespace cpu::syscall {
-    extern "C" { void *__syscall_table[12]; }
+    extern "C" { void *__syscall_table[16]; }
     
     void init_syscall_table() {
         __syscall_table[0]  = (void*)&sched::syscall_exit;
@@ -20,5 +20,9 @@ namespace cpu::syscall {
         __syscall_table[9]  = (void*)&fs::vfs::syscall_getcwd;
         __syscall_table[10] = (void*)&fs::vfs::syscall_chdir;
         __syscall_table[11] = (void*)&mem::vmm::syscall_mmap;
+        __syscall_table[12] = (void*)&sched::syscall_fork;
+        __syscall_table[13] = (void*)&mem::vmm::syscall_munmap;
+        __syscall_table[14] = (void*)&mem::vmm::syscall_mprotect;
+        __syscall_table[15] = (void*)&mem::vmm::syscall_madvise;
     }
 }
@@ -5,6 +5,7 @@
 #include <sched/sched.hpp>
 #include <ps2/kbd/keyboard.hpp>
 #include <cpu/syscall/syscall.hpp>
+#include <mem/page_cache.hpp>
 
 namespace fs::vfs {
     static Node *root = nullptr;
@@ -196,6 +197,7 @@ namespace fs::vfs {
         FileDescriptor *descriptor = task->file_descriptors[fd];
         if (descriptor == nullptr) return;
         fs::vfs::FileSystem *fs = descriptor->node->fs;
+        mem::page_cache::invalidate((FileNode*)descriptor->node, descriptor->cursor, count);
         fs->write(fs, descriptor->node, buf, count, descriptor->cursor);
         descriptor->cursor += count;
     }
@@ -209,6 +211,7 @@ namespace fs::vfs {
         FileDescriptor *descriptor = task->file_descriptors[fd];
         if (descriptor == nullptr) return;
         fs::vfs::FileSystem *fs = descriptor->node->fs;
+        mem::page_cache::invalidate((FileNode*)descriptor->node, offset, count);
         fs->write(fs, descriptor->node, buf, count, offset);
     }
 
@@ -2,6 +2,7 @@
 
 #include <klib/types.hpp>
 #include <klib/hashmap.hpp>
+#include <mem/slab.hpp>
 
 namespace fs::vfs {
     struct FileSystem;
@@ -21,11 +22,15 @@ namespace fs::vfs {
 
         Node(Type type, FileSystem *fs, Node *parent, const char *name);
         virtual ~Node();
+
+        SLAB_ALLOCATED(Node)
     };
 
     struct FileNode : public Node {
         FileNode(FileSystem *fs, Node *parent, const char *name);
         virtual ~FileNode();
+
+        SLAB_ALLOCATED(FileNode)
     };
 
     struct DirectoryNode : public Node {
@@ -35,10 +40,12 @@ namespace fs::vfs {
         virtual ~DirectoryNode();
 
         void create_dotentries();
+
+        SLAB_ALLOCATED(DirectoryNode)
     };
 
     struct DeviceNode : public Node {
-        
+        SLAB_ALLOCATED(DeviceNode)
     };
 
     struct FileSystem {
@@ -66,6 +73,8 @@ namespace fs::vfs {
     struct FileDescriptor {
         fs::vfs::Node *node;
         usize cursor;
+
+        SLAB_ALLOCATED(FileDescriptor)
     };
 
     int syscall_open(const char *path);
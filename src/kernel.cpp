@@ -16,6 +16,11 @@
 #include <mem/pmm.hpp>
 #include <mem/vmm.hpp>
 #include <mem/allocator.hpp>
+#include <mem/slab.hpp>
+#include <mem/profiler.hpp>
+#include <mem/page_cache.hpp>
+#include <mem/swap.hpp>
+#include <mem/page_merge.hpp>
 #include <panic.hpp>
 #include <acpi/tables.hpp>
 #include <sched/timer/pit.hpp>
@@ -116,20 +121,23 @@ extern "C" [[noreturn]] void _start() {
 
     mem::vmm::init(hhdm, memmap_req.response, kernel_addr_req.response);
     klib::printf("VMM: Initialized\n");
+    mem::page_cache::init();
+    mem::swap::init();
+    mem::page_merge::init();
     
     gfx::kernel_terminal();
     gfx::set_kernel_terminal_ready();
     klib::printf("Terminal: Initialized\n");
 
     auto alloc = mem::BuddyAlloc::get();
-    const u64 heap_size = 1024 * 1024 * 1024;
-    alloc->init(~(u64)0 - heap_size - 0x1000 + 1, heap_size);
-    klib::printf("Allocator: Initialized, base: %#lX\n", (uptr)alloc->head);
+    alloc->init(mem::vmm::kernel_heap_base, mem::vmm::kernel_heap_size);
+    klib::printf("Allocator: Initialized, base: %#lX\n", alloc->base);
     
     cpu::smp_init(smp_req.response);
 
     klib::printf("ACPI: Parsing ACPI tables and enabling APIC\n");
     acpi::parse_rsdp((uptr)rsdp_req.response->address);
+    mem::vmm::init_shootdown();
 
     cpu::syscall::init_syscall_table();
     
@@ -173,6 +181,15 @@ extern "C" [[noreturn]] void _start() {
     while (true) {
         if (test_task->sched_list.next == nullptr) {
             klib::printf("Test task died, rebooting in 3 seconds\n");
+            mem::print_slab_stats();
+            mem::print_heap_stats();
+            mem::vmm::print_tlb_stats();
+            mem::page_cache::print_stats();
+            mem::swap::print_stats();
+            mem::page_merge::print_stats();
+#if ALLOC_PROFILING
+            mem::profiler::print();
+#endif
             sched::timer::hpet::stall_ms(3000);
             cpu::write_cr3(0);
         }
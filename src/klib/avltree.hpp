@@ -0,0 +1,174 @@
+#pragma once
+
+#include <klib/types.hpp>
+
+// ptr: pointer to an AVLNode, type: type of struct that the AVLNode is in, member: the name of the AVLNode in the struct
+#define AVL_ENTRY(ptr, type, member) (type*)((uptr)ptr - offsetof(type, member))
+
+namespace klib {
+    struct AVLNode {
+        AVLNode *left, *right, *parent;
+        isize height;
+    };
+
+    // intrusive self balancing binary search tree
+    // Traits::less(const AVLNode *a, const AVLNode *b) orders the nodes
+    // Traits::update(AVLNode *node) recomputes augmented data from the node and its children,
+    // it is called bottom up on every node whose subtree changed
+    template<typename Traits>
+    struct AVLTree {
+        AVLNode *root = nullptr;
+
+        inline bool empty() const {
+            return root == nullptr;
+        }
+
+        void insert(AVLNode *node) {
+            node->left = nullptr;
+            node->right = nullptr;
+            node->height = 1;
+
+            AVLNode *parent = nullptr;
+            AVLNode **link = &root;
+            while (*link) {
+                parent = *link;
+                link = Traits::less(node, parent) ? &parent->left : &parent->right;
+            }
+            node->parent = parent;
+            *link = node;
+            retrace(node);
+        }
+
+        void remove(AVLNode *node) {
+            AVLNode *retrace_from;
+            if (node->left == nullptr || node->right == nullptr) {
+                AVLNode *child = node->left ? node->left : node->right;
+                replace_child(node->parent, node, child);
+                if (child)
+                    child->parent = node->parent;
+                retrace_from = node->parent;
+            } else {
+                // put the in-order successor in the place of the removed node
+                AVLNode *successor = leftmost(node->right);
+                if (successor->parent == node) {
+                    retrace_from = successor;
+                } else {
+                    retrace_from = successor->parent;
+                    successor->parent->left = successor->right;
+                    if (successor->right)
+                        successor->right->parent = successor->parent;
+                    successor->right = node->right;
+                    node->right->parent = successor;
+                }
+                successor->left = node->left;
+                node->left->parent = successor;
+                successor->parent = node->parent;
+                successor->height = node->height;
+                replace_child(node->parent, node, successor);
+            }
+            node->left = node->right = node->parent = nullptr;
+            retrace(retrace_from);
+        }
+
+        AVLNode* first() const {
+            return root ? leftmost(root) : nullptr;
+        }
+
+        static AVLNode* next(AVLNode *node) {
+            if (node->right)
+                return leftmost(node->right);
+            while (node->parent && node->parent->right == node)
+                node = node->parent;
+            return node->parent;
+        }
+
+        static AVLNode* prev(AVLNode *node) {
+            if (node->left) {
+                node = node->left;
+                while (node->right)
+                    node = node->right;
+                return node;
+            }
+            while (node->parent && node->parent->left == node)
+                node = node->parent;
+            return node->parent;
+        }
+
+    private:
+        static inline isize height(AVLNode *node) {
+            return node ? node->height : 0;
+        }
+
+        static inline AVLNode* leftmost(AVLNode *node) {
+            while (node->left)
+                node = node->left;
+            return node;
+        }
+
+        static inline void update(AVLNode *node) {
+            isize left = height(node->left), right = height(node->right);
+            node->height = 1 + (left > right ? left : right);
+            Traits::update(node);
+        }
+
+        inline void replace_child(AVLNode *parent, AVLNode *old_child, AVLNode *new_child) {
+            if (parent == nullptr)
+                root = new_child;
+            else if (parent->left == old_child)
+                parent->left = new_child;
+            else
+                parent->right = new_child;
+        }
+
+        AVLNode* rotate_left(AVLNode *node) {
+            AVLNode *pivot = node->right;
+            node->right = pivot->left;
+            if (pivot->left)
+                pivot->left->parent = node;
+            pivot->parent = node->parent;
+            replace_child(node->parent, node, pivot);
+            pivot->left = node;
+            node->parent = pivot;
+            update(node);
+            update(pivot);
+            return pivot;
+        }
+
+        AVLNode* rotate_right(AVLNode *node) {
+            AVLNode *pivot = node->left;
+            node->left = pivot->right;
+            if (pivot->right)
+                pivot->right->parent = node;
+            pivot->parent = node->parent;
+            replace_child(node->parent, node, pivot);
+            pivot->right = node;
+            node->parent = pivot;
+            update(node);
+            update(pivot);
+            return pivot;
+        }
+
+        // returns the root of the rebalanced subtree
+        AVLNode* rebalance(AVLNode *node) {
+            update(node);
+            isize balance = height(node->left) - height(node->right);
+            if (balance > 1) {
+                if (height(node->left->left) < height(node->left->right))
+                    rotate_left(node->left);
+                return rotate_right(node);
+            }
+            if (balance < -1) {
+                if (height(node->right->right) < height(node->right->left))
+                    rotate_right(node->right);
+                return rotate_left(node);
+            }
+            return node;
+        }
+
+        // walks up to the root since augmented data has to be updated all the way
+        void retrace(AVLNode *node) {
+            while (node)
+                node = rebalance(node)->parent;
+        }
+    };
+}
@@ -5,29 +5,72 @@
 
 namespace klib {
     struct Bitmap {
-        u8 *m_buffer;
-        usize m_size;
+        u64 *m_buffer;
+        usize m_size; // in bits
         
         Bitmap() {}
-        Bitmap(u8 *buffer, usize size) : m_buffer(buffer), m_size(size) {}
+        Bitmap(u64 *buffer, usize size) : m_buffer(buffer), m_size(size) {}
+
+        static constexpr usize bytes_required(usize bits) {
+            return (bits + 63) / 64 * 8;
+        }
 
         inline bool get(usize index) const {
-            return (m_buffer[index / 8] >> (index % 8)) & 1;
+            return (m_buffer[index / 64] >> (index % 64)) & 1;
         }
 
         inline void set(usize index, bool value) {
-            usize d = index / 8;
-            usize r = index % 8;
-            m_buffer[d] &= ~(1 << r);
-            m_buffer[d] |= value << r;
+            u64 mask = (u64)1 << (index % 64);
+            if (value)
+                m_buffer[index / 64] |= mask;
+            else
+                m_buffer[index / 64] &= ~mask;
         }
 
         inline void fill(bool value) {
-            klib::memset(m_buffer, ~(u8)0, m_size / 8);
+            klib::memset(m_buffer, value ? ~(u8)0 : 0, bytes_required(m_size));
+        }
+
+        // sets or clears count bits starting at index, a whole word at a time where possible
+        inline void set_range(usize index, usize count, bool value) {
+            while (count) {
+                usize bit = index % 64;
+                usize n = 64 - bit < count ? 64 - bit : count;
+                u64 mask = n == 64 ? ~(u64)0 : (((u64)1 << n) - 1) << bit;
+                if (value)
+                    m_buffer[index / 64] |= mask;
+                else
+                    m_buffer[index / 64] &= ~mask;
+                index += n;
+                count -= n;
+            }
+        }
+
+        // returns the index of the first clear bit at or after index, or m_size if there is none
+        inline usize find_first_clear(usize index) const {
+            return find_first(index, ~(u64)0);
+        }
+
+        // returns the index of the first set bit at or after index, or m_size if there is none
+        inline usize find_first_set(usize index) const {
+            return find_first(index, 0);
+        }
 
-            for (usize i = 0; i < m_size % 8; i++) {
-                set(m_size - i, true);
+    private:
+        // flip is xored into every word so that the search is always for a set bit
+        inline usize find_first(usize index, u64 flip) const {
+            if (index >= m_size)
+                return m_size;
+            usize word = index / 64;
+            u64 bits = (m_buffer[word] ^ flip) & (~(u64)0 << (index % 64));
+            usize words = (m_size + 63) / 64;
+            while (bits == 0) {
+                if (++word >= words)
+                    return m_size;
+                bits = m_buffer[word] ^ flip;
             }
+            usize result = word * 64 + __builtin_ctzll(bits);
+            return result < m_size ? result : m_size;
         }
     };
 }
@@ -0,0 +1,133 @@
+#include <klib/compress.hpp>
+#include <klib/cstring.hpp>
+
+namespace klib {
+    constexpr usize min_match = 4;
+    constexpr usize max_offset = 0xFFFF;
+
+    static inline u32 read32(const u8 *ptr) {
+        u32 value;
+        memcpy(&value, ptr, 4);
+        return value;
+    }
+
+    static inline usize hash32(u32 value) {
+        return (value * 2654435761u) >> 20; // 12 bits, see lz_table_size
+    }
+
+    // writes a 4 bit count to the token and the rest of it to the extra bytes
+    static inline u8* write_count(u8 *op, usize count) {
+        for (count -= 15; count >= 255; count -= 255)
+            *op++ = 255;
+        *op++ = count;
+        return op;
+    }
+
+    // worst case size of a sequence, the token, the extra bytes of both counts, the literals and the offset
+    static inline usize sequence_size(usize literals, usize match) {
+        return 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1;
+    }
+
+    static u8* write_sequence(u8 *op, const u8 *literals, usize literal_count, usize offset, usize match) {
+        u8 *token = op++;
+        *token = (literal_count < 15 ? literal_count : 15) << 4;
+        if (literal_count >= 15)
+            op = write_count(op, literal_count);
+        memcpy(op, literals, literal_count);
+        op += literal_count;
+        if (match == 0)
+            return op; // the last literals
+
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        match -= min_match;
+        *token |= match < 15 ? match : 15;
+        if (match >= 15)
+            op = write_count(op, match);
+        return op;
+    }
+
+    usize lz_compress(const u8 *src, usize size, u8 *dst, usize capacity, u16 *table) {
+        memset(table, 0, lz_table_size * sizeof(u16)); // positions are stored + 1 so 0 means empty
+        usize ip = 0, anchor = 0;
+        u8 *op = dst, *end = dst + capacity;
+        usize misses = 0;
+
+        while (ip + min_match <= size) {
+            u32 sequence = read32(src + ip);
+            usize hash = hash32(sequence);
+            usize ref = table[hash];
+            table[hash] = ip + 1;
+            if (ref == 0 || ip - (ref - 1) > max_offset || read32(src + ref - 1) != sequence) {
+                ip += 1 + (misses++ >> 5); // skip faster through data that doesnt compress
+                continue;
+            }
+            ref--;
+            misses = 0;
+
+            usize match = min_match;
+            while (ip + match < size && src[ref + match] == src[ip + match])
+                match++;
+            if ((usize)(end - op) < sequence_size(ip - anchor, match))
+                return 0;
+            op = write_sequence(op, src + anchor, ip - anchor, ip - ref, match);
+            ip += match;
+            anchor = ip;
+        }
+
+        if (anchor < size) {
+            if ((usize)(end - op) < sequence_size(size - anchor, 0))
+                return 0;
+            op = write_sequence(op, src + anchor, size - anchor, 0, 0);
+        }
+        return op - dst;
+    }
+
+    // reads the extra bytes of a count, returns false if they run past the end
+    static inline bool read_count(const u8 *&ip, const u8 *end, usize &count) {
+        u8 byte;
+        do {
+            if (ip == end)
+                return false;
+            byte = *ip++;
+            count += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    bool lz_decompress(const u8 *src, usize src_size, u8 *dst, usize size) {
+        const u8 *ip = src, *end = src + src_size;
+        usize op = 0;
+        while (op < size) {
+            if (ip == end)
+                return false;
+            u8 token = *ip++;
+
+            usize literal_count = token >> 4;
+            if (literal_count == 15 && !read_count(ip, end, literal_count))
+                return false;
+            if (literal_count > (usize)(end - ip) || literal_count > size - op)
+                return false;
+            memcpy(dst + op, ip, literal_count);
+            ip += literal_count;
+            op += literal_count;
+            if (op == size)
+                break;
+
+            if (end - ip < 2)
+                return false;
+            usize offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            usize match = token & 0xF;
+            if (match == 15 && !read_count(ip, end, match))
+                return false;
+            match += min_match;
+            if (offset == 0 || offset > op || match > size - op)
+                return false;
+            // byte by byte since the match may overlap the bytes it produces
+            for (usize i = 0; i < match; i++, op++)
+                dst[op] = dst[op - offset];
+        }
+        return true;
+    }
+}
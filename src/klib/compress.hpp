@@ -0,0 +1,16 @@
+#pragma once
+
+#include <klib/types.hpp>
+
+namespace klib {
+    // byte oriented lz77 in the style of lz4: one hash probe per position and no entropy coding, built for speed
+    // a sequence is a token (literal count << 4 | match length - 4), the literals, a 16 bit offset and the match,
+    // counts of 15 or more continue in extra bytes that each add up to 255, the last sequence may end after its literals
+    constexpr usize lz_table_size = 4096; // u16 entries of the hash table that lz_compress needs
+
+    // returns the compressed size, or 0 if the result doesnt fit in capacity bytes
+    usize lz_compress(const u8 *src, usize size, u8 *dst, usize capacity, u16 *table);
+
+    // decompresses exactly size bytes and returns false if src is malformed, src_size only bounds the reads
+    bool lz_decompress(const u8 *src, usize src_size, u8 *dst, usize size);
+}
@@ -63,11 +63,11 @@ extern "C" void __cxa_pure_virtual() {
 }
  
 void* operator new(usize size) {
-    return klib::malloc(size);
+    return klib::malloc_for(size, __builtin_return_address(0));
 }
  
 void* operator new[](usize size) {
-    return klib::malloc(size);
+    return klib::malloc_for(size, __builtin_return_address(0));
 }
  
 void operator delete(void *ptr) {
@@ -1,26 +1,48 @@
 #include <klib/cstdlib.hpp>
 #include <klib/cstdio.hpp>
+#include <mem/profiler.hpp>
 
 namespace klib {
-    void* malloc(usize size) {
-        auto ptr = mem::BuddyAlloc::get()->malloc(size);
-        // printf("malloc(%ld): %#lX\n", size, (uptr)ptr);
+    void* malloc_for(usize size, void *caller) {
+        auto ptr = mem::cached_malloc(size);
+#if ALLOC_PROFILING
+        if (ptr)
+            mem::set_alloc_site(ptr, mem::profiler::record_alloc((uptr)caller, size));
+#endif
         return ptr;
     }
 
+    void* malloc(usize size) {
+        return malloc_for(size, __builtin_return_address(0));
+    }
+
     void* calloc(usize size) {
-        auto ptr = mem::BuddyAlloc::get()->malloc(size);
+        auto ptr = malloc_for(size, __builtin_return_address(0));
         memset(ptr, 0, size);
         return ptr;
     }
 
     void* realloc(void *ptr, usize size) {
-        return mem::BuddyAlloc::get()->realloc(ptr, size);
+#if ALLOC_PROFILING
+        u16 old_site = ptr ? mem::alloc_site(ptr) : 0;
+        usize old_size = ptr ? mem::alloc_size(ptr) : 0;
+        void *new_ptr = mem::cached_realloc(ptr, size);
+        if (ptr && (new_ptr || size == 0))
+            mem::profiler::record_free(old_site, old_size);
+        if (new_ptr)
+            mem::set_alloc_site(new_ptr, mem::profiler::record_alloc((uptr)__builtin_return_address(0), size));
+        return new_ptr;
+#else
+        return mem::cached_realloc(ptr, size);
+#endif
     }
 
     void free(void *ptr) {
-        // printf("free(): %#lX\n", (uptr)ptr);
-        mem::BuddyAlloc::get()->free(ptr);
+#if ALLOC_PROFILING
+        if (ptr)
+            mem::profiler::record_free(mem::alloc_site(ptr), mem::alloc_size(ptr));
+#endif
+        mem::cached_free(ptr);
     }
     
     // required for weird shit
@@ -6,6 +6,7 @@
 
 namespace klib {
     void* malloc(usize size);
+    void* malloc_for(usize size, void *caller); // caller is who the allocation profiler blames, for operator new
     void* calloc(usize size);
     void* realloc(void *ptr, usize size);
     void free(void *ptr);
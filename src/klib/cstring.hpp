@@ -8,6 +8,8 @@ namespace klib {
     extern "C" void* memcpy(void *dst, const void *src, usize size);
     extern "C" void* memmove(void *dst, const void *src, usize size);
     extern "C" void* memset(void *dst, u8 value, usize size);
+    extern "C" void clear_pages(void *dst, usize num_pages);
+    extern "C" void clear_pages_nt(void *dst, usize num_pages); // bypasses the cache
 
     usize strlen(const char *str);
     char* strcpy(char *dst, const char *src);
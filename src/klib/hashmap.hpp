@@ -1,6 +1,8 @@
 #pragma once
 
 #include <klib/cstdlib.hpp>
+#include <klib/type_name.hpp>
+#include <mem/slab.hpp>
 
 #define HASHMAP_DELETED_ENTRY (Entry*)(~(uptr)0)
 
@@ -19,6 +21,8 @@ namespace klib {
         struct Entry {
             const char *key;
             V value;
+
+            SLAB_ALLOCATED_AS(Entry, klib::TypeName<HashMap>::value) // one cache per value type
         };
 
         Entry **m_array;
@@ -6,13 +6,24 @@
 #define DETECT_DEADLOCK 1
 
 namespace klib {
+    static inline bool interrupts_enabled() {
+        u64 rflags;
+        asm volatile("pushfq; pop %0" : "=r" (rflags));
+        return rflags & 0x200;
+    }
+
+    // called while a lock spins with interrupts off, so requests that other cpus wait for (tlb shootdowns) still get answered
+    inline void (*spin_hook)() = nullptr;
+
     struct Spinlock {
         volatile bool locked = false;
+        bool restore_interrupts = false; // interrupt flag from before the lock was taken
 #if DETECT_DEADLOCK
         u32 i = 0;
 #endif
 
         inline void lock() {
+            bool were_enabled = interrupts_enabled();
             asm volatile("cli");
             while (__atomic_test_and_set(&this->locked, __ATOMIC_ACQUIRE)) {
 #if DETECT_DEADLOCK
@@ -20,19 +31,55 @@ namespace klib {
                 if (i == 10000000)
                     panic("Spinlock spun too much");
 #endif
+                if (spin_hook)
+                    spin_hook();
                 asm volatile("pause");
             }
+            restore_interrupts = were_enabled;
+        }
+
+        // for paths that must not wait, e.g. reclaim running under a lock that the holder might be waiting on
+        inline bool try_lock() {
+            bool were_enabled = interrupts_enabled();
+            asm volatile("cli");
+            if (__atomic_test_and_set(&this->locked, __ATOMIC_ACQUIRE)) {
+                if (were_enabled)
+                    asm volatile("sti");
+                return false;
+            }
+            restore_interrupts = were_enabled;
+            return true;
         }
 
         inline void unlock() {
 #if DETECT_DEADLOCK
             i = 0;
 #endif
+            bool restore = restore_interrupts;
             __atomic_clear(&this->locked, __ATOMIC_RELEASE);
-            asm volatile("sti");
+            if (restore)
+                asm volatile("sti");
         }
     };
 
+    // keeps interrupts disabled for its lifetime, used to protect per-cpu data
+    class InterruptGuard {
+        bool restore;
+
+    public:
+        InterruptGuard() : restore(interrupts_enabled()) {
+            asm volatile("cli");
+        }
+
+        ~InterruptGuard() {
+            if (restore)
+                asm volatile("sti");
+        }
+
+        InterruptGuard(const InterruptGuard&) = delete;
+        InterruptGuard& operator =(const InterruptGuard&) = delete;
+    };
+
     template<class T>
     concept BasicLockable = requires(T l) {
         l.lock();
@@ -55,3 +55,37 @@ memcmp:
 
   .done:
     ret
+
+; clears whole 4 KiB pages, rdi: page aligned destination, rsi: number of pages
+global clear_pages
+clear_pages:
+    mov rcx, rsi
+    shl rcx, 9 ; 512 qwords per page
+    xor eax, eax
+    rep stosq
+    ret
+
+; same as clear_pages but with non temporal stores, so the pages dont evict anything from the cache
+global clear_pages_nt
+clear_pages_nt:
+    mov rcx, rsi
+    shl rcx, 6 ; 64 cache lines per page
+    jz .done
+    xor eax, eax
+
+  .loop:
+    movnti [rdi], rax
+    movnti [rdi + 8], rax
+    movnti [rdi + 16], rax
+    movnti [rdi + 24], rax
+    movnti [rdi + 32], rax
+    movnti [rdi + 40], rax
+    movnti [rdi + 48], rax
+    movnti [rdi + 56], rax
+    add rdi, 64
+    dec rcx
+    jnz .loop
+    sfence
+
+  .done:
+    ret
@@ -17,6 +17,9 @@
 #define MAP_ANONYMOUS 0x08
 #define MAP_NORESERVE 0x10
 
+#define MADV_MERGEABLE   12
+#define MADV_UNMERGEABLE 13
+
 #define EDOM 1
 #define EILSEQ 2
 #define ERANGE 3
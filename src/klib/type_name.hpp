@@ -0,0 +1,29 @@
+#pragma once
+
+#include <klib/types.hpp>
+
+namespace klib {
+    // the name of T as the compiler spells it, e.g. "fs::vfs::Node*", usable in constant initialisers
+    template<typename T>
+    struct TypeName {
+        struct Buffer {
+            char data[128] = {};
+        };
+
+        // cut out of "... [with T = fs::vfs::Node*]" (gcc) or "... [T = fs::vfs::Node *]" (clang)
+        static constexpr Buffer extract() {
+            const char *signature = __PRETTY_FUNCTION__;
+            usize i = 0;
+            while (!(signature[i] == 'T' && signature[i + 1] == ' ' && signature[i + 2] == '=' && signature[i + 3] == ' '))
+                i++;
+            i += 4;
+            Buffer buffer;
+            for (usize n = 0; signature[i] && signature[i] != ']' && signature[i] != ';' && n < sizeof(buffer.data) - 1; n++)
+                buffer.data[n] = signature[i++];
+            return buffer;
+        }
+
+        static constexpr Buffer buffer = extract();
+        static constexpr const char *value = buffer.data;
+    };
+}
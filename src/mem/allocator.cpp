@@ -1,33 +1,47 @@
 #include <mem/allocator.hpp>
+#include <mem/pmm.hpp>
+#include <mem/vmm.hpp>
 #include <klib/cstring.hpp>
 #include <klib/lock.hpp>
 #include <klib/cstdio.hpp>
+#include <klib/algorithm.hpp>
+#include <cpu/cpu.hpp>
+#include <panic.hpp>
 
 namespace mem {
     static klib::Spinlock alloc_lock;
 
-    BuddyAlloc::Block* BuddyAlloc::Block::split_until(usize size) {
-        if (size == 0) return nullptr;
-        auto block = this;
-        auto current_actual_size = size_required(block->size);
-        while (size < current_actual_size) {
-            current_actual_size /= 2;
-            block->size = current_actual_size;
-            // klib::printf("%#lX size %#lX split -> %#lX & %#lX size %#lX, req %#lX\n", (uptr)block, current_actual_size * 2, (uptr)block, (uptr)block->next(), current_actual_size, size);
-            block = block->next();
-            block->size = current_actual_size;
-            block->is_free = true;
-        }
-        if (size <= current_actual_size)
-            return block;
-        return nullptr; // death
+    usize large_alloc_threshold = 4 * 0x1000;
+    usize heap_reclaim_threshold = 64 * 1024;
+
+    // the reclaim hook of the heap, gives up if the heap itself is what needs the memory
+    static usize reclaim_heap(usize target_pages) {
+        if (!alloc_lock.try_lock())
+            return 0;
+        usize freed = BuddyAlloc::get()->reclaim(target_pages);
+        alloc_lock.unlock();
+        return freed;
     }
 
     void BuddyAlloc::init(uptr base, usize size) {
-        this->head = (Block*)base;
-        this->head->size = size;
-        this->head->is_free = true;
-        this->tail = this->head->next();
+        this->base = base;
+        this->size = size;
+        this->reallocs_in_place = 0;
+        this->reallocs_moved = 0;
+        for (usize i = 0; i <= max_order; i++)
+            free_lists[i].init();
+
+        // the heap doesnt have to be a power of two, cover it with the largest blocks that fit,
+        // it is demand paged so they start out reclaimed
+        usize offset = 0;
+        while (size - offset >= (usize(1) << min_order)) {
+            usize order = max_order;
+            while ((usize(1) << order) > size - offset || offset % (usize(1) << order))
+                order--;
+            push_block((Block*)(base + offset), order, true);
+            offset += usize(1) << order;
+        }
+        pmm::add_reclaim_hook(reclaim_heap, pmm::ReclaimCost::UNUSED);
     }
 
     BuddyAlloc* BuddyAlloc::get() {
@@ -35,111 +49,134 @@ namespace mem {
         return &alloc;
     }
 
-    BuddyAlloc::Block* BuddyAlloc::find_best(usize size) {
-        // klib::printf("Trying to find best block with size %#lX\n", size);
-        Block *best = nullptr;
-        Block *block = this->head;
-        Block *buddy = block->next();
-        // klib::printf("1 block: %#lX, buddy: %#lX\n", (uptr)block, (uptr)buddy);
-        
-        if (buddy == this->tail && block->is_free) {
-            return block->split_until(size);
-        }
-
-        while (block < this->tail && buddy < this->tail) { // make sure the buddies are within the range
-            // if both buddies are free, coobjalesce them together
-            if (block->is_free && buddy->is_free && block->size == buddy->size) {
-                // klib::printf("Coalescing %#lX & %#lX at size %#lX into block %#lX size %#lX\n", (uptr)block, (uptr)buddy, block->size, (uptr)block, block->size * 2);
-                block->size *= 2;
-                if (size <= block->size && (best == nullptr || block->size <= best->size))
-                    best = block;
-                
-                block = buddy->next();
-                if (block < this->tail)
-                    buddy = block->next(); // delay the buddy block for the next iteration
-                // klib::printf("2 block: %#lX, buddy: %#lX\n", (uptr)block, (uptr)buddy);
-                continue;
-            }
-            
-            auto actual_best_size = best ? size_required(best->size) : 0;
-            if (block->is_free && size <= block->size && (best == nullptr || block->size <= actual_best_size))
-                best = block;
-            
-            if (buddy->is_free && size <= buddy->size && (best == nullptr || buddy->size < actual_best_size)) 
-                best = buddy;
-            
-            if (size_required(block->size) <= size_required(buddy->size)) {
-                block = buddy->next();
-                if (block < this->tail)
-                    buddy = block->next(); // delay the buddy block for the next iteration
-                // klib::printf("3 block: %#lX, buddy: %#lX\n", (uptr)block, (uptr)buddy);
-            } else {
-                // buddy was split into smaller blocks
-                block = buddy;
-                buddy = buddy->next();
-                // klib::printf("4 block: %#lX, buddy: %#lX\n", (uptr)block, (uptr)buddy);
-            }
-        }
-        
-        if (best) {
-            // klib::printf("Found best block with size %#lX\n", best->size);
-            return best->split_until(size);
-        }
-        return nullptr;
-    }
-
-    void BuddyAlloc::coalescence() {
-        while (1) { // keep looping until there are no more buddies to coalesce
-            auto block = this->head;   
-            auto buddy = block->next();
-            
-            bool no_coalescence = true;
-            while (block < this->tail && buddy < this->tail) { // make sure the buddies are within the range
-                if (block->is_free && buddy->is_free && block->size == buddy->size) {
-                    // coalesce buddies into one
-                    // klib::printf("Coalescing %#lX & %#lX at size %#lX into block %#lX size %#lX\n", (uptr)block, (uptr)buddy, block->size, (uptr)block, block->size * 2);
-                    block->size *= 2;
-                    block = block->next();
-                    if (block < this->tail) {
-                        buddy = block->next();
-                        no_coalescence = false;
-                    }
-                } else if (size_required(block->size) < size_required(buddy->size)) {
-                    // split the buddy block into smaller blocks
-                    block = buddy;
-                    buddy = buddy->next();
-                } else {
-                    block = buddy->next();
-                    if (block < this->tail) 
-                        buddy = block->next(); // leave the buddy block for the next iteration
-                }
-            }
-            
-            if (no_coalescence)
-                return;
+    BuddyAlloc::Block* BuddyAlloc::buddy_of(Block *block, usize order) {
+        uptr buddy = base + (((uptr)block - base) ^ (usize(1) << order));
+        if (buddy + (usize(1) << order) > base + size)
+            return nullptr; // the block is at the end of a heap that isnt a power of two
+        return (Block*)buddy;
+    }
+
+    // blocks that are still backed go to the front so they are used first, reclaim takes them from there too
+    void BuddyAlloc::push_block(Block *block, usize order, bool reclaimed) {
+        block->order = order;
+        block->is_free = true;
+        block->reclaimed = reclaimed;
+        if (reclaimed)
+            free_lists[order].add_before(&((FreeBlock*)block)->list);
+        else
+            free_lists[order].add(&((FreeBlock*)block)->list);
+    }
+
+    void BuddyAlloc::remove_block(Block *block) {
+        ((FreeBlock*)block)->list.remove();
+        block->is_free = false;
+    }
+
+    // alloc_lock must be held
+    BuddyAlloc::Block* BuddyAlloc::alloc_block(usize order) {
+        usize current = order;
+        while (current <= max_order && free_lists[current].empty())
+            current++;
+        if (current > max_order)
+            return nullptr;
+
+        FreeBlock *entry = LIST_ENTRY(free_lists[current].next, FreeBlock, list);
+        Block *block = &entry->header;
+        bool reclaimed = block->reclaimed;
+        remove_block(block);
+
+        // split the block and give back the upper halves, only their headers get backed again
+        while (current > order) {
+            current--;
+            push_block((Block*)((uptr)block + (usize(1) << current)), current, reclaimed);
         }
+        block->order = order;
+        return block;
     }
 
-    void* BuddyAlloc::malloc(usize size) {
-        klib::LockGuard guard(alloc_lock);
+    // alloc_lock must be held
+    void BuddyAlloc::free_block(Block *block) {
+        usize order = block->order;
+        while (order < max_order) {
+            Block *buddy = buddy_of(block, order);
+            if (buddy == nullptr || !buddy->is_free || buddy->order != order)
+                break;
+            remove_block(buddy);
+            if (buddy < block)
+                block = buddy;
+            order++;
+        }
+        // the pages stay backed until reclaim needs them, so a free never waits for an unmap
+        push_block(block, order, false);
+    }
 
-        if (size != 0) {
-            usize actual_size = size_required(size + sizeof(Block));
+    // absorbs the buddies above the block until it has the given order, alloc_lock must be held
+    bool BuddyAlloc::grow_in_place(Block *block, usize order) {
+        // every buddy on the way has to be free and whole, check them all before changing anything
+        for (usize current = block->order; current < order; current++) {
+            if (((uptr)block - base) & (usize(1) << current))
+                return false; // the block is the upper buddy at this order
+            Block *buddy = buddy_of(block, current);
+            if (buddy == nullptr || !buddy->is_free || buddy->order != current)
+                return false;
+        }
+        for (usize current = block->order; current < order; current++)
+            remove_block(buddy_of(block, current));
+        block->order = order;
+        return true;
+    }
 
-            auto found = this->find_best(actual_size);
-            if (!found) {
-                this->coalescence();
-                found = this->find_best(actual_size);
-            }
+    // gives the upper halves of the block back until it has the given order, alloc_lock must be held
+    void BuddyAlloc::shrink_in_place(Block *block, usize order) {
+        while (block->order > order) {
+            block->order--;
+            Block *upper = (Block*)((uptr)block + (usize(1) << block->order));
+            upper->order = block->order;
+            upper->is_free = false;
+            free_block(upper);
+        }
+    }
 
-            if (found) {
-                found->size = size + sizeof(Block);
-                found->is_free = false;
-                return found->data();
+    usize BuddyAlloc::reclaim(usize target_pages) {
+        if (heap_reclaim_threshold == 0)
+            return 0;
+        // everything but the page with the header and the free list links can go back to the pmm,
+        // the backed blocks are at the front of each list and move to the back once reclaimed
+        usize min_reclaim_order = klib::max<usize>(order_for(heap_reclaim_threshold), 13);
+        usize freed = 0;
+        for (usize order = max_order; order >= min_reclaim_order && freed < target_pages; order--) {
+            while (!free_lists[order].empty() && freed < target_pages) {
+                FreeBlock *entry = LIST_ENTRY(free_lists[order].next, FreeBlock, list);
+                if (entry->header.reclaimed)
+                    break;
+                usize pages;
+                if (!vmm::get_kernel_pagemap()->try_unmap_pages((uptr)entry + 0x1000, (usize(1) << order) - 0x1000, &pages))
+                    return freed; // a page fault on this cpu or another one holds the kernel pagemap
+                entry->list.remove();
+                push_block(&entry->header, order, true);
+                freed += pages;
             }
         }
+        return freed;
+    }
 
-        return nullptr;
+    bool BuddyAlloc::contains(void *ptr) {
+        return (uptr)ptr > this->base && (uptr)ptr < this->base + this->size;
+    }
+
+    void* BuddyAlloc::malloc(usize size) {
+        if (size == 0)
+            return nullptr;
+
+        klib::LockGuard guard(alloc_lock);
+        Block *block = alloc_block(order_for(size + sizeof(Block)));
+        if (block == nullptr)
+            return nullptr;
+        block->size = size + sizeof(Block);
+        block->is_free = false;
+        block->owner_cpu = no_owner;
+        block->site = 0;
+        return block->data();
     }
 
     void* BuddyAlloc::realloc(void *ptr, usize size) {
@@ -151,49 +188,245 @@ namespace mem {
             return nullptr;
         }
 
-        klib::LockGuard guard(alloc_lock);
-
-        if (uptr old_data = (uptr)ptr) {
-            if ((uptr)this->head > old_data) return nullptr;
-            if ((uptr)this->tail <= old_data) return nullptr;
-            
-            auto old_block = (Block*)(old_data - sizeof(Block));
-            usize old_size = old_block->size;
-            usize actual_new_size = size_required(size + sizeof(Block));
+        if (!contains(ptr))
+            return nullptr;
 
-            if (size_required(old_size) == actual_new_size) {
+        auto old_block = (Block*)((uptr)ptr - sizeof(Block));
+        {
+            klib::LockGuard guard(alloc_lock);
+            usize order = order_for(size + sizeof(Block));
+            if (order < old_block->order)
+                shrink_in_place(old_block, order);
+            if (order == old_block->order || grow_in_place(old_block, order)) {
                 old_block->size = size + sizeof(Block);
-                return old_block->data();
-            }
-            
-            auto found = this->find_best(actual_new_size);
-            if (!found) {
-                this->coalescence();
-                found = this->find_best(actual_new_size);
-            }
-            
-            if (found) {
-                found->size = size + sizeof(Block);
-                found->is_free = false;
-                klib::memcpy(found->data(), ptr, old_size - sizeof(Block));
-                old_block->is_free = true;
-                return found->data();
+                reallocs_in_place++;
+                return ptr;
             }
+            reallocs_moved++;
         }
 
-        return nullptr;
+        void *new_ptr = malloc(size);
+        if (new_ptr == nullptr)
+            return nullptr;
+        klib::memcpy(new_ptr, ptr, klib::min(old_block->size - sizeof(Block), size));
+        free(ptr);
+        return new_ptr;
+    }
+
+    usize BuddyAlloc::alloc_blocks(usize order, Block **blocks, usize count) {
+        klib::LockGuard guard(alloc_lock);
+        for (usize i = 0; i < count; i++) {
+            blocks[i] = alloc_block(order);
+            if (blocks[i] == nullptr)
+                return i;
+        }
+        return count;
+    }
+
+    void BuddyAlloc::free_blocks(Block **blocks, usize count) {
+        klib::LockGuard guard(alloc_lock);
+        for (usize i = 0; i < count; i++)
+            free_block(blocks[i]);
+    }
+
+    void print_heap_stats() {
+        auto alloc = BuddyAlloc::get();
+        klib::printf("Heap: %ld reallocs in place, %ld moved\n", alloc->reallocs_in_place, alloc->reallocs_moved);
     }
 
     void BuddyAlloc::free(void *ptr) {
+        if (ptr == nullptr || !contains(ptr))
+            return;
+
         klib::LockGuard guard(alloc_lock);
+        auto block = (Block*)((uptr)ptr - sizeof(Block));
+        if (block->is_free)
+            panic("Heap: Double free of %#lX", (uptr)ptr);
+        free_block(block);
+    }
+
+    constexpr usize max_cached_order = 11; // 2 KiB blocks
+
+    struct HeapCache {
+        static constexpr usize capacity = 32;
+        static constexpr usize batch = capacity / 2;
+
+        struct SizeClass {
+            usize count;
+            BuddyAlloc::Block *blocks[capacity];
+        };
+
+        SizeClass classes[max_cached_order - BuddyAlloc::min_order + 1];
+        BuddyAlloc::Block *remote_frees; // freed by other cpus, linked through the block data
+    };
+
+    static HeapCache heap_caches[cpu::max_cpus];
+
+    static inline BuddyAlloc::Block*& next_remote_free(BuddyAlloc::Block *block) {
+        return *(BuddyAlloc::Block**)block->data();
+    }
+
+    // moves the blocks other cpus gave back into the cache, interrupts must be disabled
+    static void take_remote_frees(HeapCache &cache) {
+        BuddyAlloc::Block *block = __atomic_exchange_n(&cache.remote_frees, nullptr, __ATOMIC_ACQUIRE);
+        while (block) {
+            BuddyAlloc::Block *next = next_remote_free(block);
+            auto &size_class = cache.classes[block->order - BuddyAlloc::min_order];
+            if (size_class.count < HeapCache::capacity)
+                size_class.blocks[size_class.count++] = block;
+            else
+                BuddyAlloc::get()->free_blocks(&block, 1);
+            block = next;
+        }
+    }
+
+    // large allocations live in the hhdm and the first page remembers their size
+    static void* large_malloc(usize size) {
+        uptr phy = pmm::try_alloc_pages(klib::align_up<usize, 0x1000>(size) / 0x1000);
+        if (phy == 0)
+            return nullptr;
+        auto *page = pmm::phy_to_page(phy);
+        page->flags |= pmm::Page::LARGE_ALLOC;
+        page->owner_index = size;
+        return (void*)(phy + vmm::get_hhdm());
+    }
+
+    // returns the first page of a large allocation, or nullptr if ptr isnt one
+    static pmm::Page* large_alloc_page(void *ptr) {
+        if ((uptr)ptr & 0xFFF || (uptr)ptr < vmm::get_hhdm())
+            return nullptr;
+        auto *page = pmm::phy_to_page((uptr)ptr - vmm::get_hhdm());
+        return page && (page->flags & pmm::Page::LARGE_ALLOC) ? page : nullptr;
+    }
+
+    void* cached_malloc(usize size) {
+        if (size == 0)
+            return nullptr;
+        if (size >= large_alloc_threshold) {
+            if (void *ptr = large_malloc(size))
+                return ptr;
+            // not enough contiguous physical memory, the heap might still have room
+        }
+        usize order = BuddyAlloc::order_for(size + sizeof(BuddyAlloc::Block));
+        if (order > max_cached_order)
+            return BuddyAlloc::get()->malloc(size);
+
+        klib::InterruptGuard guard;
+        usize cpu = cpu::current_cpu_number();
+        auto &cache = heap_caches[cpu];
+        auto &size_class = cache.classes[order - BuddyAlloc::min_order];
+        if (size_class.count == 0) {
+            take_remote_frees(cache);
+            if (size_class.count == 0)
+                size_class.count = BuddyAlloc::get()->alloc_blocks(order, size_class.blocks, HeapCache::batch);
+            if (size_class.count == 0)
+                return nullptr;
+        }
+
+        BuddyAlloc::Block *block = size_class.blocks[--size_class.count];
+        block->size = size + sizeof(BuddyAlloc::Block);
+        block->owner_cpu = cpu;
+        block->site = 0;
+        return block->data();
+    }
+
+    void* cached_realloc(void *ptr, usize size) {
+        if (ptr == nullptr)
+            return cached_malloc(size);
+        if (size == 0) {
+            cached_free(ptr);
+            return nullptr;
+        }
+
+        usize old_size;
+        if (auto *page = large_alloc_page(ptr)) {
+            old_size = page->owner_index;
+            if (size >= large_alloc_threshold && klib::align_up<usize, 0x1000>(size) == klib::align_up<usize, 0x1000>(old_size)) {
+                page->owner_index = size;
+                return ptr;
+            }
+        } else if (BuddyAlloc::get()->contains(ptr)) {
+            if (size < large_alloc_threshold)
+                return BuddyAlloc::get()->realloc(ptr, size);
+            old_size = ((BuddyAlloc::Block*)((uptr)ptr - sizeof(BuddyAlloc::Block)))->size - sizeof(BuddyAlloc::Block);
+        } else {
+            return nullptr;
+        }
+
+        // moving between the heap and whole pages
+        void *new_ptr = cached_malloc(size);
+        if (new_ptr == nullptr)
+            return nullptr;
+        klib::memcpy(new_ptr, ptr, klib::min(old_size, size));
+        cached_free(ptr);
+        return new_ptr;
+    }
+
+    static BuddyAlloc::Block* heap_block(void *ptr) {
+        if (!BuddyAlloc::get()->contains(ptr))
+            return nullptr;
+        return (BuddyAlloc::Block*)((uptr)ptr - sizeof(BuddyAlloc::Block));
+    }
+
+    usize alloc_size(void *ptr) {
+        if (auto *page = large_alloc_page(ptr))
+            return page->owner_index;
+        if (auto *block = heap_block(ptr))
+            return block->size - sizeof(BuddyAlloc::Block);
+        return 0;
+    }
+
+    u16 alloc_site(void *ptr) {
+        if (auto *page = large_alloc_page(ptr))
+            return (uptr)page->owner;
+        if (auto *block = heap_block(ptr))
+            return block->site;
+        return 0;
+    }
+
+    void set_alloc_site(void *ptr, u16 site) {
+        if (auto *page = large_alloc_page(ptr))
+            page->owner = (void*)(uptr)site;
+        else if (auto *block = heap_block(ptr))
+            block->site = site;
+    }
+
+    void cached_free(void *ptr) {
+        if (ptr == nullptr)
+            return;
+        if (auto *page = large_alloc_page(ptr)) {
+            usize num_pages = klib::align_up<usize, 0x1000>(page->owner_index) / 0x1000;
+            pmm::free_pages((uptr)ptr - vmm::get_hhdm(), num_pages);
+            return;
+        }
+
+        auto alloc = BuddyAlloc::get();
+        if (!alloc->contains(ptr))
+            return;
+        auto block = (BuddyAlloc::Block*)((uptr)ptr - sizeof(BuddyAlloc::Block));
+        if (block->order > max_cached_order) {
+            alloc->free(ptr);
+            return;
+        }
+
+        klib::InterruptGuard guard;
+        usize cpu = cpu::current_cpu_number();
+        if (block->owner_cpu != BuddyAlloc::no_owner && block->owner_cpu != cpu) {
+            // give it back to the cpu it came from without taking any lock
+            auto &owner = heap_caches[block->owner_cpu];
+            BuddyAlloc::Block *head = __atomic_load_n(&owner.remote_frees, __ATOMIC_RELAXED);
+            do {
+                next_remote_free(block) = head;
+            } while (!__atomic_compare_exchange_n(&owner.remote_frees, &head, block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+            return;
+        }
 
-        if (uptr data = (uptr)ptr) {
-            if ((uptr)this->head > data) return;
-            if ((uptr)this->tail <= data) return;
-            
-            auto block = (Block*)(data - sizeof(Block));
-            block->size = size_required(block->size);
-            block->is_free = true;
+        auto &size_class = heap_caches[cpu].classes[block->order - BuddyAlloc::min_order];
+        if (size_class.count == HeapCache::capacity) {
+            size_class.count -= HeapCache::batch;
+            alloc->free_blocks(&size_class.blocks[size_class.count], HeapCache::batch);
         }
+        block->owner_cpu = cpu;
+        size_class.blocks[size_class.count++] = block;
     }
 }
@@ -1,53 +1,91 @@
 #pragma once
 
 #include <klib/types.hpp>
+#include <klib/list.hpp>
 
 namespace mem {
     // based on https://www.gingerbill.org/article/2021/12/02/memory-allocation-strategies-006/
+    // free blocks are kept in one list per order and merged with their buddy as soon as both are free
     class BuddyAlloc {
         BuddyAlloc() {}
         
     public:
         static constexpr usize alignment = 16;
-
-        static constexpr usize align(usize i) {
-            return i % alignment ? ((i / alignment) + 1) * alignment : i;
-        }
-
-        static constexpr usize size_required(usize size) {
-            usize actual_size = alignment;
-            size = align(size); 
-            while (size > actual_size)
-                actual_size *= 2;
-            return actual_size;
-        }
+        static constexpr usize min_order = 5; // 32 bytes, enough for the header and the free list links
+        static constexpr usize max_order = 30; // 1 GiB
 
         struct Block {
-            usize size; // size of the actual data stored including header, use size_required() to find the actual block size
+            usize size; // size of the actual data stored including header
+            u8 order; // the block is 2^order bytes
             bool is_free;
+            bool reclaimed; // free and nothing past the first page is backed by memory
+            u8 owner_cpu; // the cpu whose heap cache the block came from, or no_owner
+            u16 site; // allocation profiler call site
 
             inline void* data() const {
                 return (void*)((uptr)this + sizeof(*this));
             }
+        };
+        static_assert(sizeof(Block) == alignment);
 
-            inline Block* next() const {
-                return (Block*)((uptr)this + size_required(this->size));
-            }
+        static constexpr u8 no_owner = 0xFF;
 
-            Block* split_until(usize size);
+        // free blocks also link themselves into the free list of their order
+        struct FreeBlock {
+            Block header;
+            klib::ListHead list;
         };
 
+        static constexpr usize order_for(usize size) {
+            usize order = min_order;
+            while ((usize(1) << order) < size)
+                order++;
+            return order;
+        }
+
         void init(uptr base, usize size);
         static BuddyAlloc* get();
 
-        Block *head;
-        Block *tail;
-
-        Block* find_best(usize size);
-        void coalescence();
+        uptr base;
+        usize size;
+        klib::ListHead free_lists[max_order + 1];
+        usize reallocs_in_place, reallocs_moved; // resizes that kept their block and ones that needed a new block
 
         void* malloc(usize size);
         void* realloc(void *ptr, usize size);
         void free(void *ptr);
+        usize reclaim(usize target_pages); // alloc_lock must be held, returns the pages that went back to the pmm
+
+        // take the lock once for a batch of blocks, these are used by the per-cpu heap caches
+        usize alloc_blocks(usize order, Block **blocks, usize count);
+        void free_blocks(Block **blocks, usize count);
+
+        bool contains(void *ptr);
+
+    private:
+        Block* buddy_of(Block *block, usize order);
+        void push_block(Block *block, usize order, bool reclaimed);
+        void remove_block(Block *block);
+        Block* alloc_block(usize order);
+        void free_block(Block *block);
+        bool grow_in_place(Block *block, usize order);
+        void shrink_in_place(Block *block, usize order);
     };
+
+    // allocations of at least this many bytes get their own pages from the pmm instead of a heap block
+    extern usize large_alloc_threshold;
+    // the pages behind free heap blocks of at least this many bytes go back to the pmm, 0 keeps them
+    extern usize heap_reclaim_threshold;
+
+    // per-cpu caches of small blocks in front of BuddyAlloc, used by klib::malloc, realloc and free
+    void* cached_malloc(usize size);
+    void* cached_realloc(void *ptr, usize size);
+    void cached_free(void *ptr);
+
+    void print_heap_stats();
+
+    // used by the allocation profiler, work for both heap blocks and large allocations
+    usize alloc_size(void *ptr);
+    u16 alloc_site(void *ptr);
+    void set_alloc_site(void *ptr, u16 site);
 }
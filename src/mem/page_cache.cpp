@@ -0,0 +1,130 @@
+#include <mem/page_cache.hpp>
+#include <mem/pmm.hpp>
+#include <mem/vmm.hpp>
+#include <klib/lock.hpp>
+#include <klib/cstdio.hpp>
+#include <klib/cstring.hpp>
+#include <fs/vfs.hpp>
+
+namespace mem::page_cache {
+    constexpr usize bucket_count = 1024;
+
+    // cached pages are chained through Page::list, their owner is the file and owner_index the offset
+    static klib::ListHead buckets[bucket_count];
+    static klib::Spinlock cache_lock;
+    static usize cached_pages = 0, hits = 0, misses = 0, evictions = 0;
+    static usize evict_cursor = 0; // the bucket eviction continues at
+
+    // the lock must be held
+    static void drop_page(pmm::Page *page) {
+        page->list.remove();
+        page->flags &= ~pmm::Page::FILE_BACKED;
+        page->owner = nullptr;
+        page->owner_index = 0;
+        cached_pages--;
+        pmm::unref_page(pmm::page_to_phy(page));
+    }
+
+    // the reclaim hook of the page cache, frees the pages nothing maps anymore, visiting the buckets round robin
+    static usize evict_pages(usize target_pages) {
+        if (!cache_lock.try_lock())
+            return 0;
+        // only the cache holds these, references are taken under the lock so they stay unused while it is held
+        usize freed = 0;
+        for (usize visited = 0; visited < bucket_count && freed < target_pages; visited++) {
+            klib::ListHead *bucket = &buckets[evict_cursor];
+            evict_cursor = (evict_cursor + 1) % bucket_count;
+            for (klib::ListHead *entry = bucket->next; entry != bucket && freed < target_pages;) {
+                pmm::Page *page = LIST_ENTRY(entry, pmm::Page, list);
+                entry = entry->next;
+                if (pmm::page_refcount(pmm::page_to_phy(page)) != 1)
+                    continue;
+                drop_page(page);
+                freed++;
+            }
+        }
+        evictions += freed;
+        cache_lock.unlock();
+        return freed;
+    }
+
+    void init() {
+        for (usize i = 0; i < bucket_count; i++)
+            buckets[i].init();
+        pmm::add_reclaim_hook(evict_pages, pmm::ReclaimCost::CLEAN);
+    }
+
+    static inline klib::ListHead* bucket_for(fs::vfs::FileNode *file, usize offset) {
+        u64 key = (uptr(file) >> 4) ^ (offset / 0x1000) * 0x9E3779B97F4A7C15;
+        return &buckets[(key ^ (key >> 32)) % bucket_count];
+    }
+
+    // the lock must be held
+    static pmm::Page* find(fs::vfs::FileNode *file, usize offset) {
+        klib::ListHead *bucket = bucket_for(file, offset);
+        for (klib::ListHead *entry = bucket->next; entry != bucket; entry = entry->next) {
+            pmm::Page *page = LIST_ENTRY(entry, pmm::Page, list);
+            if (page->owner == file && page->owner_index == offset)
+                return page;
+        }
+        return nullptr;
+    }
+
+    uptr get_page(fs::vfs::FileNode *file, usize offset) {
+        {
+            klib::LockGuard guard(cache_lock);
+            if (pmm::Page *page = find(file, offset)) {
+                hits++;
+                uptr phy = pmm::page_to_phy(page);
+                pmm::ref_page(phy);
+                return phy;
+            }
+        }
+
+        // the read can take long and allocate, so it runs without the lock and another cpu might cache the page meanwhile
+        uptr phy = pmm::alloc_pages(1);
+        void *data = (void*)(phy + vmm::get_hhdm());
+        isize read = file->fs->read(file->fs, file, data, 0x1000, offset);
+        if (read < 0)
+            read = 0;
+        klib::memset((u8*)data + read, 0, 0x1000 - read);
+
+        uptr existing = 0;
+        {
+            klib::LockGuard guard(cache_lock);
+            if (pmm::Page *cached = find(file, offset)) {
+                hits++;
+                existing = pmm::page_to_phy(cached);
+                pmm::ref_page(existing);
+            } else {
+                misses++;
+                pmm::Page *page = pmm::phy_to_page(phy);
+                page->flags |= pmm::Page::FILE_BACKED;
+                page->owner = file;
+                page->owner_index = offset;
+                bucket_for(file, offset)->add(&page->list);
+                cached_pages++;
+                pmm::ref_page(phy); // one for the cache and one for the caller
+            }
+        }
+        if (existing) {
+            pmm::free_pages(phy, 1);
+            return existing;
+        }
+        return phy;
+    }
+
+    void invalidate(fs::vfs::FileNode *file, usize offset, usize count) {
+        klib::LockGuard guard(cache_lock);
+        if (cached_pages == 0)
+            return;
+        for (usize page_offset = offset & ~(usize)0xFFF; page_offset < offset + count; page_offset += 0x1000) {
+            if (pmm::Page *page = find(file, page_offset))
+                drop_page(page);
+        }
+    }
+
+    void print_stats() {
+        klib::printf("Page cache: %ld pages, hits: %ld, misses: %ld, evictions: %ld\n", cached_pages, hits, misses, evictions);
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <klib/types.hpp>
+
+namespace fs::vfs {
+    struct FileNode;
+}
+
+namespace mem::page_cache {
+    // file pages that are mapped read only into every pagemap that maps that part of the file,
+    // the cache keeps one reference to each page and every mapping one more,
+    // pages with only the reference of the cache left are evicted by reclaim
+    void init();
+
+    // returns the page holding the file contents at a page aligned offset, with a reference taken for the caller
+    uptr get_page(fs::vfs::FileNode *file, usize offset);
+
+    // drops the cached pages that overlap the written bytes, mappings keep the old contents
+    void invalidate(fs::vfs::FileNode *file, usize offset, usize count);
+
+    void print_stats();
+}
@@ -0,0 +1,111 @@
+#include <mem/page_merge.hpp>
+#include <mem/pmm.hpp>
+#include <mem/vmm.hpp>
+#include <klib/lock.hpp>
+#include <klib/list.hpp>
+#include <klib/cstdio.hpp>
+#include <klib/cstring.hpp>
+
+namespace mem::page_merge {
+    constexpr usize bucket_count = 1024;
+
+    // merged pages are chained through Page::list, owner_index is their hash
+    static klib::ListHead buckets[bucket_count];
+    static klib::Spinlock merge_lock;
+    static usize shared_pages = 0;
+    static usize merges = 0, zero_page_merges = 0, unmerges = 0;
+
+    void init() {
+        for (usize i = 0; i < bucket_count; i++)
+            buckets[i].init();
+    }
+
+    static inline u64 rotate_left(u64 value, int bits) {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    u64 hash_page(const void *data) {
+        const u64 *words = (const u64*)data;
+        // four independent lanes so the multiplies of consecutive words overlap
+        u64 lanes[4] = { 0x9E3779B97F4A7C15, 0xC2B2AE3D27D4EB4F, 0x165667B19E3779F9, 0x27D4EB2F165667C5 };
+        for (usize i = 0; i < 0x1000 / sizeof(u64); i += 4) {
+            for (usize lane = 0; lane < 4; lane++)
+                lanes[lane] = rotate_left(lanes[lane] ^ words[i + lane], 31) * 0x9E3779B97F4A7C15;
+        }
+        u64 hash = rotate_left(lanes[0], 1) ^ rotate_left(lanes[1], 7) ^ rotate_left(lanes[2], 12) ^ rotate_left(lanes[3], 18);
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCD;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    static inline klib::ListHead* bucket_for(u64 hash) {
+        return &buckets[hash % bucket_count];
+    }
+
+    uptr find(const void *data, u64 hash) {
+        klib::LockGuard guard(merge_lock);
+        klib::ListHead *bucket = bucket_for(hash);
+        for (klib::ListHead *entry = bucket->next; entry != bucket; entry = entry->next) {
+            pmm::Page *page = LIST_ENTRY(entry, pmm::Page, list);
+            if (page->owner_index != hash)
+                continue;
+            uptr phy = pmm::page_to_phy(page);
+            if (klib::memcmp(data, (void*)(phy + vmm::get_hhdm()), 0x1000) == 0) {
+                pmm::ref_page(phy);
+                return phy;
+            }
+        }
+        return 0;
+    }
+
+    void insert(uptr phy, u64 hash) {
+        klib::LockGuard guard(merge_lock);
+        pmm::Page *page = pmm::phy_to_page(phy);
+        page->flags |= pmm::Page::MERGED;
+        page->owner_index = hash;
+        bucket_for(hash)->add(&page->list);
+        pmm::ref_page(phy);
+        shared_pages++;
+    }
+
+    void prune() {
+        klib::LockGuard guard(merge_lock);
+        if (shared_pages == 0)
+            return;
+        for (usize i = 0; i < bucket_count; i++) {
+            for (klib::ListHead *entry = buckets[i].next; entry != &buckets[i]; ) {
+                pmm::Page *page = LIST_ENTRY(entry, pmm::Page, list);
+                entry = entry->next;
+                uptr phy = pmm::page_to_phy(page);
+                if (pmm::page_refcount(phy) != 1)
+                    continue;
+                // only the table still has it, nothing can take a new reference without the lock
+                page->list.remove();
+                page->flags &= ~pmm::Page::MERGED;
+                page->owner_index = 0;
+                shared_pages--;
+                pmm::unref_page(phy);
+            }
+        }
+    }
+
+    void count_merge(bool zero_page) {
+        __atomic_add_fetch(zero_page ? &zero_page_merges : &merges, 1, __ATOMIC_RELAXED);
+    }
+
+    void count_unmerge() {
+        __atomic_add_fetch(&unmerges, 1, __ATOMIC_RELAXED);
+    }
+
+    void print_stats() {
+        klib::LockGuard guard(merge_lock);
+        usize mappings = 0;
+        for (usize i = 0; i < bucket_count; i++) {
+            for (klib::ListHead *entry = buckets[i].next; entry != &buckets[i]; entry = entry->next)
+                mappings += pmm::page_refcount(pmm::page_to_phy(LIST_ENTRY(entry, pmm::Page, list))) - 1;
+        }
+        klib::printf("Page merging: %ld shared pages mapped %ld times, %ld merges, %ld into the zero page, %ld unmerged by writes\n",
+            shared_pages, mappings, merges, zero_page_merges, unmerges);
+    }
+}
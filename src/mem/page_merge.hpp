@@ -0,0 +1,25 @@
+#pragma once
+
+#include <klib/types.hpp>
+
+namespace mem::page_merge {
+    // anonymous pages with identical contents are merged into one read only page that all their mappings share,
+    // the table keeps one reference to each merged page and every mapping one more, a write copies the page again
+    void init();
+
+    u64 hash_page(const void *data);
+
+    // returns a merged page with the same contents as data, with a reference taken for the caller, or 0
+    uptr find(const void *data, u64 hash);
+
+    // makes the page the merged copy of its contents, the table takes its own reference
+    void insert(uptr phy, u64 hash);
+
+    // drops the merged pages that no mapping uses anymore
+    void prune();
+
+    void count_merge(bool zero_page); // a mapping was pointed at a merged page or the zero page
+    void count_unmerge(); // a write gave a mapping its own copy of a merged page
+
+    void print_stats();
+}
@@ -1,21 +1,118 @@
 #include <mem/pmm.hpp>
 #include <klib/lock.hpp>
+#include <klib/list.hpp>
 #include <klib/cstdio.hpp>
 #include <klib/cstring.hpp>
 #include <klib/algorithm.hpp>
+#include <cpu/cpu.hpp>
+#include <sched/sched.hpp>
 #include <panic.hpp>
 #include <limine.hpp>
 
 namespace mem::pmm {
+    // per-cpu stack of free single pages, refilled from and drained to the free lists in batches
+    struct PageMagazine {
+        static constexpr usize capacity = 64;
+        static constexpr usize batch = capacity / 2;
+
+        usize count;
+        uptr pages[capacity];
+    };
+
+    // pages that were cleared ahead of time by zeroing_thread
+    struct ZeroedPool {
+        static constexpr usize capacity = 256;
+
+        usize count;
+        uptr pages[capacity];
+    };
+
     static klib::Spinlock pmm_lock;
-    static usize page_bitmap_index = 0;
+    static PageMagazine magazines[cpu::max_cpus];
+    static klib::Spinlock zeroed_pool_lock;
+    static ZeroedPool zeroed_pool;
+    static uptr hhdm_base = 0;
+
+    static klib::ListHead free_lists[max_order + 1];
+    static Page *pages = nullptr;
+    static usize page_count = 0;
 
     static uptr last_usable_mem = 0;
     static usize total_usable_size = 0;
     static usize total_allocated = 0;
 
+    static usize min_watermark = 0, low_watermark = 0, high_watermark = 0; // in pages
+    constexpr usize max_reclaim_hooks = 4;
+    static ReclaimHook reclaim_hooks[max_reclaim_hooks]; // sorted by cost
+    static ReclaimCost reclaim_costs[max_reclaim_hooks];
+    static usize reclaim_hook_count = 0;
+    static bool reclaiming[cpu::max_cpus]; // may use the memory below the min watermark and doesnt reclaim again
+
+    static inline usize order_for(usize num_pages) {
+        usize order = 0;
+        while ((usize(1) << order) < num_pages)
+            order++;
+        return order;
+    }
+
+    static void push_block(usize pfn, usize order) {
+        free_lists[order].add(&pages[pfn].list);
+        pages[pfn].flags |= Page::BUDDY;
+        pages[pfn].order = order;
+    }
+
+    static void remove_block(usize pfn) {
+        pages[pfn].list.remove();
+        pages[pfn].flags &= ~Page::BUDDY;
+    }
+
+    // coalesces the block with its buddies for as long as they are free
+    static void free_block(usize pfn, usize order) {
+        while (order < max_order) {
+            usize buddy = pfn ^ (usize(1) << order);
+            if (buddy >= page_count || !(pages[buddy].flags & Page::BUDDY) || pages[buddy].order != order)
+                break;
+            remove_block(buddy);
+            pfn &= ~(usize(1) << order);
+            order++;
+        }
+        push_block(pfn, order);
+    }
+
+    // frees an arbitrary range of pages as the largest naturally aligned blocks that fit
+    static void free_range(usize pfn, usize count) {
+        while (count) {
+            usize order = pfn ? klib::min<usize>(__builtin_ctzl(pfn), max_order) : max_order;
+            while ((usize(1) << order) > count)
+                order--;
+            free_block(pfn, order);
+            pfn += usize(1) << order;
+            count -= usize(1) << order;
+        }
+    }
+
+    // returns the pfn of a block with the given order, or ~0 if there is none
+    static usize alloc_block(usize order) {
+        usize current = order;
+        while (current <= max_order && free_lists[current].empty())
+            current++;
+        if (current > max_order)
+            return ~(usize)0;
+
+        usize pfn = LIST_ENTRY(free_lists[current].next, Page, list) - pages;
+        remove_block(pfn);
+
+        // split the block and give back the upper halves
+        while (current > order) {
+            current--;
+            push_block(pfn + (usize(1) << current), current);
+        }
+        return pfn;
+    }
+
     void init(uptr hhdm, limine_memmap_response *memmap_res) {
         auto page_bitmap = get_bitmap();
+        hhdm_base = hhdm;
 
         for (usize i = 0; i < memmap_res->entry_count; i++) {
             auto entry = memmap_res->entries[i];
@@ -24,41 +121,60 @@ namespace mem::pmm {
                 last_usable_mem = new_usable_mem;
         }
 
-        page_bitmap->m_size = last_usable_mem / 0x1000;
-        klib::printf("PMM: Bitmap range: %ld KiB\n", last_usable_mem);
+        page_count = last_usable_mem / 0x1000;
+        page_bitmap->m_size = page_count;
+        klib::printf("PMM: Bitmap range: %ld KiB\n", last_usable_mem / 1024);
 
+        // the bitmap and the page array share one allocation
+        usize bitmap_bytes = klib::Bitmap::bytes_required(page_count);
+        usize pages_offset = klib::align_up<usize, 64>(bitmap_bytes);
+        usize metadata_size = klib::align_up<usize, 0x1000>(pages_offset + page_count * sizeof(Page));
+        uptr metadata_phy = 0;
         for (usize i = 0; i < memmap_res->entry_count; i++) {
             auto entry = memmap_res->entries[i];
-            if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= (page_bitmap->m_size / 8)) {
-                page_bitmap->m_buffer = (u8*)(entry->base + hhdm);
+            if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= metadata_size) {
+                metadata_phy = entry->base;
+                page_bitmap->m_buffer = (u64*)(entry->base + hhdm);
+                pages = (Page*)(entry->base + hhdm + pages_offset);
                 klib::printf("PMM: Bitmap virt addr: %#lX, bits: %#lX\n", (uptr)page_bitmap->m_buffer, page_bitmap->m_size);
                 break;
             }
         }
+        if (pages == nullptr)
+            panic("PMM: No usable memory region large enough for the page metadata");
 
         page_bitmap->fill(true);
-        
+        klib::memset(pages, 0, page_count * sizeof(Page));
+        for (usize i = 0; i <= max_order; i++)
+            free_lists[i].init();
+
         for (usize e = 0; e < memmap_res->entry_count; e++) {
             auto entry = memmap_res->entries[e];
             if (entry->type == LIMINE_MEMMAP_USABLE) {
-                usize page_start = entry->base / 0x1000;
-                usize page_end = entry->base / 0x1000 + entry->length / 0x1000;
-                if (entry->base % 0x1000)
-                    page_start++;
-                if (entry->length % 0x1000)
-                    page_end--;
-                for (usize i = page_start; i < page_end; i++) {
-                    page_bitmap->set(i, false);
-                    total_usable_size += 0x1000;
+                usize page_start = klib::align_up<uptr, 0x1000>(entry->base) / 0x1000;
+                usize page_end = (entry->base + entry->length) / 0x1000;
+                if (page_end > page_start) {
+                    page_bitmap->set_range(page_start, page_end - page_start, false);
+                    total_usable_size += (page_end - page_start) * 0x1000;
                 }
             }
         }
-        
-        usize bitmap_self_index = (uptr(page_bitmap->m_buffer) - hhdm) / 0x1000;
-        for (usize i = bitmap_self_index; i < bitmap_self_index + klib::align_up<usize, 0x1000>(page_bitmap->m_size / 8) / 0x1000; i++) {
-            page_bitmap->set(i, true);
-            total_usable_size -= 0x1000;
+
+        page_bitmap->set_range(metadata_phy / 0x1000, metadata_size / 0x1000, true);
+        total_usable_size -= metadata_size;
+
+        // build the free lists out of every run of free pages
+        for (usize i = page_bitmap->find_first_clear(0); i < page_count; ) {
+            usize end = page_bitmap->find_first_set(i);
+            free_range(i, end - i);
+            i = page_bitmap->find_first_clear(end);
         }
+
+        klib::printf("PMM: %ld KiB usable, %ld KiB of page metadata\n", total_usable_size / 1024, metadata_size / 1024);
+
+        min_watermark = klib::max<usize>(total_usable_size / 0x1000 / 256, 64);
+        low_watermark = min_watermark * 2;
+        high_watermark = min_watermark * 3;
     }
 
     klib::Bitmap* get_bitmap() {
@@ -66,61 +182,233 @@ namespace mem::pmm {
         return &page_bitmap;
     }
 
-    uptr inner_alloc(usize num_pages, usize limit) {
+    // pmm_lock must be held, returns 0 if there is no block large enough
+    static uptr alloc_locked(usize num_pages) {
+        usize order = order_for(num_pages);
+        usize pfn = order <= max_order ? alloc_block(order) : ~(usize)0;
+        if (pfn == ~(usize)0)
+            return 0;
+
+        // give back the pages that were only needed to round up to a power of two
+        usize block_pages = usize(1) << order;
+        if (block_pages > num_pages)
+            free_range(pfn + num_pages, block_pages - num_pages);
+
+        get_bitmap()->set_range(pfn, num_pages, true);
+        return pfn * 0x1000;
+    }
+
+    // pmm_lock must be held
+    static void free_locked(uptr phy, usize num_pages) {
         auto page_bitmap = get_bitmap();
-        usize pages = 0;
-
-        while (page_bitmap_index < limit) {
-            if (!page_bitmap->get(page_bitmap_index)) {
-                page_bitmap_index++;
-                pages++;
-                if (pages == num_pages) {
-                    usize beginning = page_bitmap_index - num_pages;
-                    for (usize i = beginning; i < page_bitmap_index; i++)
-                        page_bitmap->set(i, true);
-                    return beginning * 0x1000;
-                }
-            } else {
-                page_bitmap_index++;
-                pages = 0;
-            }
+
+        usize pfn = phy / 0x1000;
+        ASSERT(pfn + num_pages <= page_count);
+        usize already_free = page_bitmap->find_first_clear(pfn);
+        if (already_free < pfn + num_pages)
+            panic("PMM: Double free of physical page %#lX", already_free * 0x1000);
+        page_bitmap->set_range(pfn, num_pages, false);
+
+        free_range(pfn, num_pages);
+    }
+
+    static void refill_magazine(PageMagazine &mag) {
+        klib::LockGuard guard(pmm_lock);
+        while (mag.count < PageMagazine::batch) {
+            uptr page = alloc_locked(1);
+            if (page == 0)
+                break;
+            pages[page / 0x1000].flags = Page::FREE_CACHED;
+            mag.pages[mag.count++] = page;
         }
+    }
 
-        return 0;
+    static void drain_magazine(PageMagazine &mag) {
+        klib::LockGuard guard(pmm_lock);
+        while (mag.count > PageMagazine::capacity - PageMagazine::batch) {
+            uptr page = mag.pages[--mag.count];
+            pages[page / 0x1000].flags = 0;
+            free_locked(page, 1);
+        }
     }
 
-    uptr alloc_pages(usize num_pages) {
+    // takes pages from the magazine or the free lists, without touching the page metadata
+    static uptr take_pages(usize num_pages) {
+        if (num_pages == 1) {
+            klib::InterruptGuard guard;
+            auto &mag = magazines[cpu::current_cpu_number()];
+            if (mag.count == 0)
+                refill_magazine(mag);
+            return mag.count ? mag.pages[--mag.count] : 0;
+        }
         klib::LockGuard guard(pmm_lock);
+        return alloc_locked(num_pages);
+    }
+
+    static uptr take_zeroed_page() {
+        klib::LockGuard guard(zeroed_pool_lock);
+        return zeroed_pool.count ? zeroed_pool.pages[--zeroed_pool.count] : 0;
+    }
+
+    uptr try_alloc_pages(usize num_pages, u32 flags) {
+        if (reclaim_hook_count && !reclaiming[cpu::current_cpu_number()] && free_page_count() < min_watermark + num_pages)
+            return 0;
 
-        usize last = page_bitmap_index;
-        uptr result = inner_alloc(num_pages, get_bitmap()->m_size);
+        uptr result = 0;
+        if ((flags & ALLOC_ZEROED) && num_pages == 1)
+            result = take_zeroed_page();
+        if (result == 0)
+            result = take_pages(num_pages);
+        if (result == 0 && num_pages == 1)
+            result = take_zeroed_page(); // the pool is the last memory left
+        if (result == 0)
+            return 0;
 
-        if (result == 0) {
-            page_bitmap_index = 0; // try again from the beginning just in case
-            result = inner_alloc(num_pages, last);
-            if (result == 0)
-                panic("Out of physical memory (%ld KiB has been allocated)", total_allocated / 1024);
+        usize first_pfn = result / 0x1000;
+        bool zeroed = pages[first_pfn].flags & Page::ZEROED;
+        for (usize pfn = first_pfn; pfn < first_pfn + num_pages; pfn++) {
+            pages[pfn].refcount = 1;
+            pages[pfn].flags = 0;
+            pages[pfn].owner = nullptr;
+            pages[pfn].owner_index = 0;
         }
+        if ((flags & ALLOC_ZEROED) && !zeroed)
+            klib::clear_pages((void*)(result + hhdm_base), num_pages);
 
-        total_allocated += num_pages * 0x1000;
+        __atomic_add_fetch(&total_allocated, num_pages * 0x1000, __ATOMIC_RELAXED);
+        return result;
+    }
+
+    // runs the reclaim hooks cheapest first until enough pages are free, with the memory below the min watermark
+    // available to them, returns the pages they freed
+    static usize reclaim(usize target_pages) {
+        klib::InterruptGuard guard; // the flag belongs to whatever runs on this cpu
+        usize cpu = cpu::current_cpu_number();
+        if (reclaiming[cpu])
+            return 0;
+        reclaiming[cpu] = true;
+        usize freed = 0;
+        for (usize i = 0; i < reclaim_hook_count && freed < target_pages; i++)
+            freed += reclaim_hooks[i](target_pages - freed);
+        reclaiming[cpu] = false;
+        return freed;
+    }
+
+    uptr alloc_pages(usize num_pages, u32 flags) {
+        uptr result = try_alloc_pages(num_pages, flags);
+        while (result == 0 && reclaim(klib::max<usize>(num_pages, 32)) > 0)
+            result = try_alloc_pages(num_pages, flags);
+        if (result == 0) { // nothing is left to reclaim, the reserve is better than a panic
+            klib::InterruptGuard guard;
+            bool &flag = reclaiming[cpu::current_cpu_number()];
+            bool was_reclaiming = flag;
+            flag = true;
+            result = try_alloc_pages(num_pages, flags);
+            flag = was_reclaiming;
+        }
+        if (result == 0)
+            panic("Out of physical memory (%ld KiB has been allocated)", total_allocated / 1024);
         return result;
     }
 
     void free_pages(uptr phy, usize num_pages) {
-        klib::LockGuard guard(pmm_lock);
-        auto page_bitmap = get_bitmap();
+        // the bitmap only catches a double free once the magazine drains, by then the page may have two owners
+        if (num_pages == 1 && (pages[phy / 0x1000].flags & Page::FREE_CACHED))
+            panic("PMM: Double free of physical page %#lX", phy);
+        for (usize pfn = phy / 0x1000; pfn < phy / 0x1000 + num_pages; pfn++) {
+            pages[pfn].refcount = 0;
+            pages[pfn].flags = 0;
+        }
+
+        if (num_pages == 1) {
+            klib::InterruptGuard guard;
+            pages[phy / 0x1000].flags = Page::FREE_CACHED;
+            auto &mag = magazines[cpu::current_cpu_number()];
+            if (mag.count == PageMagazine::capacity)
+                drain_magazine(mag);
+            mag.pages[mag.count++] = phy;
+        } else {
+            klib::LockGuard guard(pmm_lock);
+            free_locked(phy, num_pages);
+        }
+
+        __atomic_sub_fetch(&total_allocated, num_pages * 0x1000, __ATOMIC_RELAXED);
+    }
+
+    Page* phy_to_page(uptr phy) {
+        if (phy / 0x1000 >= page_count)
+            return nullptr;
+        return &pages[phy / 0x1000];
+    }
 
-        usize i = phy / 0x1000;
-        if (i < page_bitmap_index)
-            page_bitmap_index = i;
-        
-        for (; i < num_pages + i; i++)
-            page_bitmap->set(i, false);
+    uptr page_to_phy(Page *page) {
+        return (page - pages) * 0x1000;
+    }
+
+    void ref_page(uptr phy) {
+        __atomic_add_fetch(&pages[phy / 0x1000].refcount, 1, __ATOMIC_RELAXED);
+    }
 
-        total_allocated -= num_pages * 0x1000;
+    void unref_page(uptr phy) {
+        if (put_page(phy))
+            free_pages(phy, 1);
+    }
+
+    bool put_page(uptr phy) {
+        return __atomic_sub_fetch(&pages[phy / 0x1000].refcount, 1, __ATOMIC_ACQ_REL) == 0;
+    }
+
+    usize page_refcount(uptr phy) {
+        return __atomic_load_n(&pages[phy / 0x1000].refcount, __ATOMIC_ACQUIRE);
     }
 
     usize get_total_allocated() {
         return total_allocated;
     }
+
+    usize free_page_count() {
+        return (total_usable_size - __atomic_load_n(&total_allocated, __ATOMIC_RELAXED)) / 0x1000;
+    }
+
+    void add_reclaim_hook(ReclaimHook hook, ReclaimCost cost) {
+        ASSERT(reclaim_hook_count < max_reclaim_hooks);
+        usize i = reclaim_hook_count++;
+        for (; i > 0 && reclaim_costs[i - 1] > cost; i--) {
+            reclaim_hooks[i] = reclaim_hooks[i - 1];
+            reclaim_costs[i] = reclaim_costs[i - 1];
+        }
+        reclaim_hooks[i] = hook;
+        reclaim_costs[i] = cost;
+    }
+
+    [[noreturn]] void zeroing_thread() {
+        while (true) {
+            while (__atomic_load_n(&zeroed_pool.count, __ATOMIC_RELAXED) < ZeroedPool::capacity) {
+                uptr page = take_pages(1);
+                if (page == 0)
+                    break;
+                klib::clear_pages_nt((void*)(page + hhdm_base), 1);
+                pages[page / 0x1000].flags = Page::ZEROED | Page::FREE_CACHED;
+
+                klib::LockGuard guard(zeroed_pool_lock);
+                if (zeroed_pool.count == ZeroedPool::capacity) {
+                    pages[page / 0x1000].flags = 0;
+                    klib::LockGuard pmm_guard(pmm_lock);
+                    free_locked(page, 1);
+                    break;
+                }
+                zeroed_pool.pages[zeroed_pool.count++] = page;
+            }
+            sched::yield(); // wait for the pool to be used up
+        }
+    }
+
+    [[noreturn]] void reclaim_thread() {
+        while (true) {
+            usize free = free_page_count();
+            if (free < low_watermark)
+                reclaim(high_watermark - free);
+            sched::yield(); // check again on the next round
+        }
+    }
 }
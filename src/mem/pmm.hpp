@@ -2,12 +2,63 @@
 
 #include <klib/types.hpp>
 #include <klib/bitmap.hpp>
+#include <klib/list.hpp>
 #include <limine.hpp>
 
 namespace mem::pmm {
+    constexpr usize max_order = 18; // 2^18 pages = 1 GiB blocks
+
+    // metadata of one physical page, indexed by pfn
+    struct Page {
+        enum Flags : u16 {
+            ZEROED = 1 << 0, // known to only contain zeroes
+            PAGE_TABLE = 1 << 1,
+            SLAB = 1 << 2,
+            FILE_BACKED = 1 << 3,
+            PINNED = 1 << 4, // must stay where it is, e.g. for dma
+            BUDDY = 1 << 5, // first page of a free block in the buddy free lists
+            LARGE_ALLOC = 1 << 6, // first page of a large kernel heap allocation, owner_index is its size in bytes and owner its profiler site
+            COMPRESSED = 1 << 7, // holds pages of the swap store, owner is the size class and owner_index the bitmap of used slots
+            MERGED = 1 << 8, // shared by identical anonymous pages, owner_index is the hash of its contents
+            FREE_CACHED = 1 << 9 // free but held by a magazine or the zeroed pool instead of the free lists
+        };
+
+        klib::ListHead list; // free list while free, otherwise for the owner to use
+        u32 refcount; // mappings or other users of the page, 0 while free
+        u16 flags;
+        u8 order; // order of the free block while BUDDY is set
+        void *owner; // e.g. the pagemap, slab cache or file that the page belongs to
+        uptr owner_index; // e.g. the virtual address or file offset of the page within the owner, the last content hash for anonymous pages
+    };
+
+    enum AllocFlags : u32 {
+        ALLOC_ZEROED = 1 << 0 // single pages come from the pool that zeroing_thread keeps filled
+    };
+
     void init(uptr hhdm, limine_memmap_response *memmap_res);
     klib::Bitmap* get_bitmap();
-    uptr alloc_pages(usize num_pages);
+    uptr alloc_pages(usize num_pages, u32 flags = 0);
+    uptr try_alloc_pages(usize num_pages, u32 flags = 0); // returns 0 instead of panicking when out of memory
     void free_pages(uptr phy, usize num_pages);
+
+    Page* phy_to_page(uptr phy); // nullptr if there is no page at phy
+    uptr page_to_phy(Page *page);
+
+    // every allocated page starts with one reference, more are taken for pages mapped by more than one pagemap
+    void ref_page(uptr phy);
+    void unref_page(uptr phy); // frees the page when the last reference is dropped
+    bool put_page(uptr phy); // like unref_page but leaves freeing the page to the caller, returns true if it has to
+    usize page_refcount(uptr phy);
     usize get_total_allocated();
+    usize free_page_count();
+
+    // below the low watermark reclaim_thread frees pages until the high watermark is reached,
+    // allocations that would go below the min watermark reclaim directly and the rest is kept for reclaim itself
+    using ReclaimHook = usize (*)(usize target_pages); // returns the number of pages it freed
+    // the hooks run cheapest first: memory nobody uses, then pages that can be read back, then pages that need swap
+    enum class ReclaimCost { UNUSED, CLEAN, SWAP };
+    void add_reclaim_hook(ReclaimHook hook, ReclaimCost cost);
+
+    [[noreturn]] void zeroing_thread();
+    [[noreturn]] void reclaim_thread();
 }
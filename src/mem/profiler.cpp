@@ -0,0 +1,55 @@
+#include <mem/profiler.hpp>
+#include <klib/cstdio.hpp>
+
+namespace mem::profiler {
+    static AllocSite sites[max_sites];
+
+    static inline u64 size_class(usize size) {
+        u64 order = 0;
+        while ((usize(1) << order) < size)
+            order++;
+        return order;
+    }
+
+    // lock free, a slot is claimed by swapping its key from 0 and the counters are atomic
+    u16 record_alloc(uptr caller, usize size) {
+        u64 key = (caller & 0xFFFFFFFFFFFF) | (size_class(size) << 48);
+        usize index = (key ^ (key >> 48)) % (max_sites - 1) + 1;
+        usize site = 0;
+        for (usize i = 0; i < max_sites - 1; i++) {
+            u64 expected = 0;
+            if (__atomic_load_n(&sites[index].key, __ATOMIC_RELAXED) == key
+                    || __atomic_compare_exchange_n(&sites[index].key, &expected, key, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+                    || expected == key) {
+                site = index;
+                break;
+            }
+            index = index % (max_sites - 1) + 1;
+        }
+
+        AllocSite &entry = sites[site];
+        __atomic_add_fetch(&entry.allocs, 1, __ATOMIC_RELAXED);
+        usize live = __atomic_add_fetch(&entry.live_bytes, size, __ATOMIC_RELAXED);
+        usize peak = __atomic_load_n(&entry.peak_bytes, __ATOMIC_RELAXED);
+        while (live > peak && !__atomic_compare_exchange_n(&entry.peak_bytes, &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        return site;
+    }
+
+    void record_free(u16 site, usize size) {
+        if (site < max_sites)
+            __atomic_sub_fetch(&sites[site].live_bytes, size, __ATOMIC_RELAXED);
+    }
+
+    void print() {
+        klib::printf("Heap allocation sites (caller | size class: allocations, live bytes, peak bytes):\n");
+        for (usize i = 0; i < max_sites; i++) {
+            AllocSite &entry = sites[i];
+            if (entry.allocs == 0)
+                continue;
+            if (i == 0)
+                klib::printf("    other: %ld, %ld, %ld\n", entry.allocs, entry.live_bytes, entry.peak_bytes);
+            else
+                klib::printf("    %#lX | <= %ld B: %ld, %ld, %ld\n", entry.key | 0xFFFF000000000000, usize(1) << (entry.key >> 48), entry.allocs, entry.live_bytes, entry.peak_bytes);
+        }
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <klib/types.hpp>
+
+#define ALLOC_PROFILING 0 // attribute kernel heap memory to the code that allocated it
+
+namespace mem::profiler {
+    // one call site and size class, the size class is log2 of the size rounded up to a power of two
+    struct AllocSite {
+        u64 key; // caller address in the low 48 bits, size class above them, 0 if unused
+        usize allocs;
+        usize live_bytes, peak_bytes;
+    };
+
+    constexpr usize max_sites = 1024; // site 0 collects everything that doesnt fit in the table
+
+    u16 record_alloc(uptr caller, usize size); // returns the site index to keep with the allocation
+    void record_free(u16 site, usize size);
+    void print();
+}
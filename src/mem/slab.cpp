@@ -0,0 +1,141 @@
+#include <mem/slab.hpp>
+#include <mem/pmm.hpp>
+#include <mem/vmm.hpp>
+#include <klib/cstdio.hpp>
+
+namespace mem {
+    // lives at the start of every slab page, the objects follow it
+    struct Slab {
+        SlabCache *cache;
+        Slab *next, *prev; // in the partial list of the cache
+        void *free_objects; // linked through the first word of every free object
+        usize in_use;
+    };
+
+    constexpr usize slab_header_size = (sizeof(Slab) + 15) & ~(usize)15;
+
+    static klib::Spinlock caches_lock;
+    static SlabCache *caches = nullptr;
+
+    static inline Slab* slab_of(void *ptr) {
+        return (Slab*)((uptr)ptr & ~(uptr)0xFFF);
+    }
+
+    static void remove_slab(Slab **head, Slab *slab) {
+        if (slab->prev)
+            slab->prev->next = slab->next;
+        else
+            *head = slab->next;
+        if (slab->next)
+            slab->next->prev = slab->prev;
+        slab->next = slab->prev = nullptr;
+    }
+
+    static void push_slab(Slab **head, Slab *slab) {
+        slab->prev = nullptr;
+        slab->next = *head;
+        if (*head)
+            (*head)->prev = slab;
+        *head = slab;
+    }
+
+    // the lock must be held
+    void SlabCache::new_slab() {
+        ASSERT(slab_header_size + object_size <= 0x1000);
+        uptr page = pmm::alloc_pages(1);
+        auto *page_info = pmm::phy_to_page(page);
+        page_info->flags |= pmm::Page::SLAB;
+        page_info->owner = this;
+
+        Slab *slab = (Slab*)(page + vmm::get_hhdm());
+        slab->cache = this;
+        slab->in_use = 0;
+        slab->free_objects = nullptr;
+        for (uptr object = uptr(slab) + 0x1000 - object_size; object >= uptr(slab) + slab_header_size; object -= object_size) {
+            *(void**)object = slab->free_objects;
+            slab->free_objects = (void*)object;
+        }
+        push_slab(&partial_slabs, slab);
+        slab_count++;
+
+        if (!registered) {
+            klib::LockGuard guard(caches_lock);
+            next_cache = caches;
+            caches = this;
+            registered = true;
+        }
+    }
+
+    // the lock must be held
+    void* SlabCache::take_object() {
+        if (partial_slabs == nullptr)
+            new_slab();
+        Slab *slab = partial_slabs;
+        void *object = slab->free_objects;
+        slab->free_objects = *(void**)object;
+        slab->in_use++;
+        if (slab->free_objects == nullptr) // full
+            remove_slab(&partial_slabs, slab);
+        return object;
+    }
+
+    // the lock must be held
+    void SlabCache::release_object(void *ptr) {
+        Slab *slab = slab_of(ptr);
+        ASSERT(slab->cache == this);
+        bool was_full = slab->free_objects == nullptr;
+        *(void**)ptr = slab->free_objects;
+        slab->free_objects = ptr;
+        slab->in_use--;
+        if (was_full)
+            push_slab(&partial_slabs, slab);
+
+        // keep one slab around even when it is empty so a single object going back and forth doesnt allocate pages
+        if (slab->in_use == 0 && (slab->next || slab->prev)) {
+            remove_slab(&partial_slabs, slab);
+            slab_count--;
+            pmm::free_pages(uptr(slab) - vmm::get_hhdm(), 1);
+        }
+    }
+
+    void SlabCache::refill(Magazine &mag) {
+        klib::LockGuard guard(lock);
+        while (mag.count < Magazine::batch)
+            mag.objects[mag.count++] = take_object();
+    }
+
+    void SlabCache::drain(Magazine &mag) {
+        klib::LockGuard guard(lock);
+        while (mag.count > Magazine::capacity - Magazine::batch)
+            release_object(mag.objects[--mag.count]);
+    }
+
+    void* SlabCache::alloc() {
+        klib::InterruptGuard guard;
+        auto &mag = magazines[cpu::current_cpu_number()];
+        if (mag.count) {
+            __atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+            refill(mag);
+        }
+        return mag.objects[--mag.count];
+    }
+
+    void SlabCache::free(void *ptr) {
+        if (ptr == nullptr)
+            return;
+        klib::InterruptGuard guard;
+        auto &mag = magazines[cpu::current_cpu_number()];
+        if (mag.count == Magazine::capacity)
+            drain(mag);
+        mag.objects[mag.count++] = ptr;
+    }
+
+    void print_slab_stats() {
+        klib::LockGuard guard(caches_lock);
+        klib::printf("Slab caches:\n");
+        for (SlabCache *cache = caches; cache; cache = cache->next_cache)
+            klib::printf("    %s | object size: %ld, slabs: %ld, hits: %ld, misses: %ld\n", cache->name, cache->object_size, cache->slab_count, cache->hits, cache->misses);
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <klib/types.hpp>
+#include <klib/lock.hpp>
+#include <cpu/cpu.hpp>
+#include <panic.hpp>
+
+// routes new and delete of a type through its own object cache, goes in the class body,
+// derived classes need their own since the cache only fits objects of exactly this type
+#define SLAB_ALLOCATED(type) SLAB_ALLOCATED_AS(type, #type)
+
+// the same with the cache name given as a constant expression, e.g. for types nested in templates
+#define SLAB_ALLOCATED_AS(type, cache_name) \
+    static mem::SlabCache& slab_cache() { \
+        static constinit mem::SlabCache cache(cache_name, sizeof(type)); \
+        return cache; \
+    } \
+    static void* operator new(usize size) { \
+        ASSERT(size == sizeof(type)); \
+        return slab_cache().alloc(); \
+    } \
+    static void operator delete(void *ptr) { \
+        slab_cache().free(ptr); \
+    }
+
+namespace mem {
+    struct Slab;
+
+    // equally sized objects carved out of single pages, with a per-cpu magazine in front of the slabs
+    struct SlabCache {
+        struct Magazine {
+            static constexpr usize capacity = 16;
+            static constexpr usize batch = capacity / 2;
+
+            usize count;
+            void *objects[capacity];
+        };
+
+        const char *name;
+        usize object_size;
+        klib::Spinlock lock;
+        Slab *partial_slabs = nullptr; // slabs with at least one free object
+        usize slab_count = 0;
+        usize hits = 0, misses = 0; // allocations served by the magazine and by the slabs
+        SlabCache *next_cache = nullptr; // all caches that have been used, for the statistics
+        bool registered = false;
+        Magazine magazines[cpu::max_cpus] = {};
+
+        constexpr SlabCache(const char *name, usize object_size) : name(name), object_size((object_size + 15) & ~(usize)15) {}
+
+        void* alloc();
+        void free(void *ptr);
+
+    private:
+        void refill(Magazine &mag);
+        void drain(Magazine &mag);
+        void new_slab();
+        void* take_object();
+        void release_object(void *ptr);
+    };
+
+    void print_slab_stats();
+}
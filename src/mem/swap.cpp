@@ -0,0 +1,170 @@
+#include <mem/swap.hpp>
+#include <mem/pmm.hpp>
+#include <mem/vmm.hpp>
+#include <klib/lock.hpp>
+#include <klib/list.hpp>
+#include <klib/compress.hpp>
+#include <klib/cstring.hpp>
+#include <klib/cstdio.hpp>
+#include <panic.hpp>
+
+namespace mem::swap {
+    constexpr usize class_granularity = 256;
+    constexpr usize class_count = 8; // up to 2 KiB, larger results dont save enough to be worth keeping
+    constexpr usize max_compressed_size = class_granularity * class_count;
+
+    // store pages are cut into equal slots, pages with a free slot are on the partial list of their class
+    struct SizeClass {
+        usize slot_size;
+        usize slots_per_page;
+        klib::ListHead partial;
+    };
+
+    static SizeClass classes[class_count];
+    static klib::Spinlock swap_lock;
+    static u16 hash_table[klib::lz_table_size];
+    static u8 compress_buffer[max_compressed_size];
+
+    static usize stored_pages = 0, zero_pages = 0, store_pages = 0;
+    static usize swap_outs = 0, swap_ins = 0, rejected = 0;
+
+    void init() {
+        for (usize i = 0; i < class_count; i++) {
+            classes[i].slot_size = (i + 1) * class_granularity;
+            classes[i].slots_per_page = 0x1000 / classes[i].slot_size;
+            classes[i].partial.init();
+        }
+    }
+
+    // a handle is the pfn of the store page and the slot in it, plus one since 0 is the zero handle
+    static inline u64 make_handle(uptr phy, usize slot) {
+        return ((phy / 0x1000) << 4 | slot) + 1;
+    }
+
+    static inline u8* slot_data(u64 handle, pmm::Page **page) {
+        u64 value = handle - 1;
+        uptr phy = (value >> 4) * 0x1000;
+        *page = pmm::phy_to_page(phy);
+        ASSERT(*page && ((*page)->flags & pmm::Page::COMPRESSED));
+        auto *size_class = (SizeClass*)(*page)->owner;
+        return (u8*)(phy + vmm::get_hhdm() + (value & 0xF) * size_class->slot_size);
+    }
+
+    // the lock must be held, returns the slot data or nullptr if no store page could be allocated
+    static u8* alloc_slot(SizeClass *size_class, u64 *handle) {
+        pmm::Page *page;
+        if (size_class->partial.empty()) {
+            uptr phy = pmm::try_alloc_pages(1);
+            if (phy == 0)
+                return nullptr;
+            page = pmm::phy_to_page(phy);
+            page->flags |= pmm::Page::COMPRESSED;
+            page->owner = size_class;
+            page->owner_index = 0;
+            size_class->partial.add(&page->list);
+            store_pages++;
+        } else {
+            page = LIST_ENTRY(size_class->partial.next, pmm::Page, list);
+        }
+
+        usize slot = __builtin_ctzl(~page->owner_index);
+        page->owner_index |= (u64)1 << slot;
+        if (page->owner_index == ((u64)1 << size_class->slots_per_page) - 1)
+            page->list.remove(); // full
+        uptr phy = pmm::page_to_phy(page);
+        *handle = make_handle(phy, slot);
+        return (u8*)(phy + vmm::get_hhdm() + slot * size_class->slot_size);
+    }
+
+    static bool is_zero(const void *page) {
+        const u64 *words = (const u64*)page;
+        for (usize i = 0; i < 0x1000 / 8; i++)
+            if (words[i])
+                return false;
+        return true;
+    }
+
+    bool store(const void *page, u64 *handle) {
+        klib::LockGuard guard(swap_lock);
+        if (is_zero(page)) {
+            *handle = zero_handle;
+            zero_pages++;
+            swap_outs++;
+            return true;
+        }
+
+        usize size = klib::lz_compress((const u8*)page, 0x1000, compress_buffer, max_compressed_size, hash_table);
+        if (size == 0) {
+            rejected++;
+            return false;
+        }
+        u8 *slot = alloc_slot(&classes[(size - 1) / class_granularity], handle);
+        if (slot == nullptr)
+            return false;
+        klib::memcpy(slot, compress_buffer, size);
+        stored_pages++;
+        swap_outs++;
+        return true;
+    }
+
+    void load(u64 handle, void *page) {
+        klib::LockGuard guard(swap_lock);
+        swap_ins++;
+        if (handle == zero_handle) {
+            klib::clear_pages(page, 1);
+            return;
+        }
+        pmm::Page *store_page;
+        u8 *data = slot_data(handle, &store_page);
+        if (!klib::lz_decompress(data, ((SizeClass*)store_page->owner)->slot_size, (u8*)page, 0x1000))
+            panic("Swap: corrupted page in slot %#lX", handle);
+    }
+
+    bool duplicate(u64 handle, u64 *copy) {
+        klib::LockGuard guard(swap_lock);
+        if (handle == zero_handle) {
+            *copy = zero_handle;
+            zero_pages++;
+            return true;
+        }
+        pmm::Page *store_page;
+        u8 *data = slot_data(handle, &store_page);
+        auto *size_class = (SizeClass*)store_page->owner;
+        u8 *slot = alloc_slot(size_class, copy);
+        if (slot == nullptr)
+            return false;
+        klib::memcpy(slot, data, size_class->slot_size);
+        stored_pages++;
+        return true;
+    }
+
+    void release(u64 handle) {
+        klib::LockGuard guard(swap_lock);
+        if (handle == zero_handle) {
+            zero_pages--;
+            return;
+        }
+        pmm::Page *page;
+        slot_data(handle, &page);
+        auto *size_class = (SizeClass*)page->owner;
+        u64 full = ((u64)1 << size_class->slots_per_page) - 1;
+        bool was_full = page->owner_index == full;
+        page->owner_index &= ~((u64)1 << ((handle - 1) & 0xF));
+        stored_pages--;
+
+        if (page->owner_index == 0) {
+            if (!was_full)
+                page->list.remove();
+            page->owner = nullptr;
+            store_pages--;
+            pmm::free_pages(pmm::page_to_phy(page), 1);
+        } else if (was_full) {
+            size_class->partial.add(&page->list);
+        }
+    }
+
+    void print_stats() {
+        klib::printf("Swap: %ld pages compressed into %ld KiB, %ld zero pages, %ld swapped out, %ld swapped in, %ld incompressible\n",
+            stored_pages, store_pages * 4, zero_pages, swap_outs, swap_ins, rejected);
+    }
+}
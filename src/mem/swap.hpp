@@ -0,0 +1,20 @@
+#pragma once
+
+#include <klib/types.hpp>
+
+namespace mem::swap {
+    // in memory swap store, reclaimed pages are kept lz compressed in slots of a few size classes,
+    // a handle names one stored page and is kept in the swap entry of the page table
+    constexpr u64 zero_handle = 0; // pages that only held zeroes take no space at all
+    constexpr u64 max_handle = ((u64)1 << 40) - 1; // fits in the address bits of a page table entry
+
+    void init();
+
+    // returns false if the page doesnt compress well enough to be worth keeping or there is no memory for it
+    bool store(const void *page, u64 *handle);
+    void load(u64 handle, void *page);
+    bool duplicate(u64 handle, u64 *copy); // for fork, the copy has to be released on its own
+    void release(u64 handle);
+
+    void print_stats();
+}
@@ -1,35 +1,86 @@
 #include <mem/vmm.hpp>
 #include <mem/pmm.hpp>
+#include <mem/page_cache.hpp>
+#include <mem/swap.hpp>
+#include <mem/page_merge.hpp>
 #include <panic.hpp>
 #include <klib/cstdio.hpp>
 #include <klib/cstring.hpp>
 #include <klib/algorithm.hpp>
 #include <klib/posix.hpp>
 #include <cpu/cpu.hpp>
+#include <cpu/interrupts/idt.hpp>
+#include <cpu/interrupts/apic.hpp>
+#include <cpu/interrupts/interrupts.hpp>
 #include <cpu/syscall/syscall.hpp>
 #include <sched/sched.hpp>
+#include <fs/vfs.hpp>
 #include <limine.hpp>
 
 namespace mem::vmm {
-    const usize heap_size = 1024 * 1024 * 1024;
-    const uptr heap_begin = ~(uptr)0 - heap_size - 0x1000;
-    const uptr heap_end = heap_begin + heap_size;
-    
+    constexpr usize huge_page_size = 0x200000; // 2 MiB
+    constexpr usize giant_page_size = 0x40000000; // 1 GiB
+    constexpr u64 phy_mask = 0x000FFFFFFFFFF000;
+    constexpr usize invlpg_threshold = 32; // pages, above this the whole TLB is flushed instead
+    constexpr usize huge_page_min_range = 4 * huge_page_size;
+    constexpr usize max_pcids = 4096;
+    constexpr uptr kernel_half = 0xFFFF800000000000;
+
     static uptr hhdm;
+    static uptr zero_page; // mapped read only into anonymous memory that has only been read so far
+    static bool giant_pages_supported = false;
+    static bool pcid_supported = false; // together with global pages
+    static bool invpcid_supported = false;
     static uptr kernel_phy_base;
     static uptr kernel_virt_base;
 
+    usize fault_around_max_pages = 64;
+
     static Pagemap kernel_pagemap;
+    static Pagemap *active_pagemaps[cpu::max_cpus];
+
+    // pcids are handed out in order, when they run out the generation moves on and every cpu flushes its tlb once
+    static klib::Spinlock pcid_lock;
+    static u16 next_pcid = 1;
+    static u64 current_pcid_generation = 1;
+    static u64 cpu_pcid_generations[cpu::max_cpus];
     static MappedRange kernel_hhdm_range;
     static MappedRange kernel_heap_range;
 
+    // every user pagemap, in the order reclaim visits them
+    static klib::ListHead user_pagemaps;
+    static klib::Spinlock user_pagemaps_lock;
+    static usize user_pagemap_count = 0;
+    static Pagemap *faulting_pagemaps[cpu::max_cpus]; // locked by a page fault on that cpu, reclaim there can use it as is
+    static uptr faulting_windows[cpu::max_cpus]; // the 2 MiB that fault populates, reclaim there leaves it alone
+
+    static usize reclaim_pages(usize target);
+
     void init(uptr hhdm_base, limine_memmap_response *memmap_res, limine_kernel_address_response *kernel_addr_res) {
         hhdm = hhdm_base;
         kernel_phy_base = kernel_addr_res->physical_base;
         kernel_virt_base = kernel_addr_res->virtual_base;
 
-        kernel_pagemap.pml4 = (u64*)(pmm::alloc_pages(1) + hhdm);
-        klib::memset(kernel_pagemap.pml4, 0, 0x1000);
+        u32 eax, ebx, ecx, edx;
+        cpu::cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+        if (eax >= 0x80000001) {
+            cpu::cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+            giant_pages_supported = edx & (1 << 26);
+        }
+        cpu::cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+        pcid_supported = (ecx & (1 << 17)) && (edx & (1 << 13));
+        cpu::cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+        if (pcid_supported && eax >= 7) {
+            cpu::cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+            invpcid_supported = ebx & (1 << 10);
+        }
+        klib::printf("VMM: 1 GiB pages: %s, PCID: %s, INVPCID: %s\n", giant_pages_supported ? "yes" : "no",
+            pcid_supported ? "yes" : "no", invpcid_supported ? "yes" : "no");
+
+        kernel_pagemap.pml4 = (u64*)(pmm::alloc_pages(1, pmm::ALLOC_ZEROED) + hhdm);
+
+        zero_page = pmm::alloc_pages(1, pmm::ALLOC_ZEROED);
+        pmm::phy_to_page(zero_page)->flags |= pmm::Page::ZEROED | pmm::Page::PINNED;
 
         usize kernel_size = 0;
 
@@ -37,7 +88,7 @@ namespace mem::vmm {
         for (u64 i = 0; i < memmap_res->entry_count; i++) {
             auto entry = memmap_res->entries[i];
             const char *entry_name;
-            u64 flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE;
+            u64 flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE | PAGE_GLOBAL;
 
             switch (entry->type) {
             case LIMINE_MEMMAP_USABLE: entry_name = "Usable"; break;
@@ -73,23 +124,31 @@ namespace mem::vmm {
         }
 */
 
-        kernel_pagemap.map_pages(kernel_phy_base, kernel_virt_base, kernel_size, PAGE_PRESENT | PAGE_WRITABLE);
-        kernel_pagemap.range_list_head.init();
+        kernel_pagemap.map_pages(kernel_phy_base, kernel_virt_base, kernel_size, PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL);
         kernel_hhdm_range = {
             .base = hhdm_base,
             .length = (u64)1024 * 1024 * 1024 * 1024,
-            .page_flags = PAGE_PRESENT | PAGE_WRITABLE,
+            .page_flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL,
             .type = MappedRange::Type::DIRECT
         };
-        kernel_pagemap.range_list_head.add(&kernel_hhdm_range.range_list);
+        kernel_pagemap.add_range(&kernel_hhdm_range);
         kernel_heap_range = { 
-            .base = heap_begin,
-            .length = heap_size,
-            .page_flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE,
+            .base = kernel_heap_base,
+            .length = kernel_heap_size,
+            .page_flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE | PAGE_GLOBAL,
             .type = MappedRange::Type::ANONYMOUS
         };
-        kernel_pagemap.range_list_head.add(&kernel_heap_range.range_list);
-        kernel_pagemap.activate();
+        kernel_pagemap.add_range(&kernel_heap_range);
+        init_cpu();
+
+        user_pagemaps.init();
+        pmm::add_reclaim_hook(reclaim_pages, pmm::ReclaimCost::SWAP);
+    }
+
+    void init_cpu() {
+        cpu::write_cr3(uptr(kernel_pagemap.pml4) - hhdm);
+        if (pcid_supported) // pcid 0 is loaded, which PCIDE requires
+            cpu::write_cr4(cpu::read_cr4() | (1 << 7) | (1 << 17));
     }
 
     uptr get_hhdm() {
@@ -100,41 +159,387 @@ namespace mem::vmm {
         return &kernel_pagemap;
     }
 
-    static u64* page_table_next_level(u64 *current_table, usize index) {
-        u64 *next_table = nullptr;
+    Pagemap* new_user_pagemap() {
+        Pagemap *pagemap = new Pagemap();
+        pagemap->pml4 = (u64*)(pmm::alloc_pages(1, pmm::ALLOC_ZEROED) + hhdm);
+        pagemap->map_kernel();
+
+        klib::LockGuard guard(user_pagemaps_lock);
+        user_pagemaps.add_before(&pagemap->user_pagemaps);
+        user_pagemap_count++;
+        return pagemap;
+    }
+
+    // level 3 is the pml4, 2 the pdpt, 1 the page directory and 0 the page table
+    static inline usize level_shift(usize level) {
+        return 12 + level * 9;
+    }
+
+    static inline usize level_page_size(usize level) {
+        return (usize)1 << level_shift(level);
+    }
+
+    // converts 4 KiB page flags to the huge page format, the PAT bit moves from bit 7 to bit 12
+    static inline u64 huge_page_flags(u64 flags) {
+        if (flags & PAGE_ATTRIBUTE_TABLE)
+            flags = (flags & ~(u64)PAGE_ATTRIBUTE_TABLE) | PAGE_HUGE_ATTRIBUTE_TABLE;
+        return flags | PAGE_HUGE;
+    }
+
+    static inline u64 small_page_flags(u64 flags) {
+        flags &= ~(u64)PAGE_HUGE;
+        if (flags & PAGE_HUGE_ATTRIBUTE_TABLE)
+            flags = (flags & ~(u64)PAGE_HUGE_ATTRIBUTE_TABLE) | PAGE_ATTRIBUTE_TABLE;
+        return flags;
+    }
+
+    static u64* new_page_table() {
+        uptr new_page = pmm::alloc_pages(1, pmm::ALLOC_ZEROED);
+        pmm::phy_to_page(new_page)->flags |= pmm::Page::PAGE_TABLE;
+        return (u64*)(new_page + hhdm);
+    }
+
+    // frees the page table pages below a table at the given level, not the pages they map
+    static void free_page_table(u64 *table, usize level) {
+        if (level > 1) {
+            for (usize i = 0; i < 512; i++)
+                if ((table[i] & PAGE_PRESENT) && !(table[i] & PAGE_HUGE))
+                    free_page_table((u64*)((table[i] & phy_mask) + hhdm), level - 1);
+        }
+        pmm::free_pages(uptr(table) - hhdm, 1);
+    }
+
+    // replaces a huge page entry with a table of 512 smaller entries mapping the same memory
+    static u64* split_huge_page(u64 *entry, usize level) {
+        usize child_size = level_page_size(level - 1);
+        uptr base = *entry & phy_mask & ~(level_page_size(level) - 1);
+        u64 flags = *entry & ~phy_mask;
+        u64 child_flags = level - 1 == 0 ? small_page_flags(flags) : flags;
+
+        u64 *table = new_page_table();
+        for (usize i = 0; i < 512; i++)
+            table[i] = (base + i * child_size) | child_flags;
+        *entry = (uptr(table) - hhdm) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+        return table;
+    }
+
+    // current_table is at the given level
+    static u64* page_table_next_level(u64 *current_table, usize index, usize level) {
         u64 current_entry = current_table[index];
         if (current_entry & PAGE_PRESENT) {
-            next_table = (u64*)((current_entry & 0x000FFFFFFFFFF000) + hhdm);
-        } else {
-            uptr new_page = pmm::alloc_pages(1);
-            klib::memset((void*)(new_page + hhdm), 0, 0x1000);
-            current_table[index] = new_page | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
-            next_table = (u64*)(new_page + hhdm);
+            if (current_entry & PAGE_HUGE)
+                return split_huge_page(&current_table[index], level);
+            return (u64*)((current_entry & phy_mask) + hhdm);
         }
+
+        u64 *next_table = new_page_table();
+        current_table[index] = (uptr(next_table) - hhdm) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
         return next_table;
     }
 
-    void Pagemap::map_page(uptr phy, uptr virt, u64 flags) {
-        klib::LockGuard guard(this->lock);
-        u64 *current_table = this->pml4;
+    // returns the entry that maps virt with a page of page_size, creating tables and splitting huge pages on the way
+    static u64* walk(u64 *pml4, uptr virt, usize page_size) {
+        u64 *current_table = pml4;
+        usize level = 3;
+        for (; level_page_size(level) > page_size; level--)
+            current_table = page_table_next_level(current_table, (virt >> level_shift(level)) & 0x1FF, level);
+        return &current_table[(virt >> level_shift(level)) & 0x1FF];
+    }
 
-        // klib::printf("Phy: %#lX, Virt: %#lX, Flags: %#lX\n", phy, virt, flags);
+    // invalidates [start, end) on the calling cpu only
+    static void flush_local(uptr start, uptr end) {
+        if ((end - start) / 0x1000 > invlpg_threshold) {
+            if (end > kernel_half)
+                cpu::flush_tlb_all(); // kernel pages are global
+            else
+                cpu::write_cr3(cpu::read_cr3());
+        } else {
+            for (uptr virt = start; virt < end; virt += 0x1000)
+                cpu::invlpg((void*)virt);
+        }
+    }
+
+    // one shootdown is in flight at a time, each target clears its bit in pending once it flushed the range
+    struct ShootdownRequest {
+        uptr start, end;
+        u64 pending;
+    };
+
+    static ShootdownRequest shootdown_request;
+    static bool shootdown_busy = false;
+    static u8 shootdown_vector = 0; // 0 until init_shootdown, nobody else is online before that
+    static usize shootdowns_sent = 0, shootdowns_received = 0;
+
+    static void answer_shootdown() {
+        u64 self = (u64)1 << cpu::current_cpu_number();
+        if (!(__atomic_load_n(&shootdown_request.pending, __ATOMIC_ACQUIRE) & self))
+            return;
+        flush_local(shootdown_request.start, shootdown_request.end);
+        __atomic_add_fetch(&shootdowns_received, 1, __ATOMIC_RELAXED);
+        __atomic_and_fetch(&shootdown_request.pending, ~self, __ATOMIC_RELEASE);
+    }
+
+    static void shootdown_handler(u64 vec, cpu::InterruptState *state) {
+        answer_shootdown();
+        cpu::interrupts::eoi();
+    }
+
+    // makes the other cpus drop [start, end) of the pagemap, or of every pagemap for the kernel half,
+    // a target that spins on a lock the caller holds answers from the spin hook instead of the ipi
+    // flushed_here tells whether the caller already flushed the range on this cpu, if not this cpu is marked stale too
+    static void shootdown(Pagemap *pagemap, uptr start, uptr end, bool flushed_here) {
+        u64 self = (u64)1 << cpu::current_cpu_number();
+        u64 targets;
+        if (end > kernel_half) {
+            targets = cpu::online_cpus(); // the kernel half is shared by every pagemap
+        } else {
+            // cpus that activate the pagemap later must not keep their entries of its pcid,
+            // marked before reading active_cpus and checked by activate() after setting it, so no cpu falls through
+            __atomic_or_fetch(&pagemap->stale_cpus, flushed_here ? ~self : ~(u64)0, __ATOMIC_SEQ_CST);
+            targets = __atomic_load_n(&pagemap->active_cpus, __ATOMIC_SEQ_CST);
+        }
+        targets &= ~self;
+        if (targets == 0 || shootdown_vector == 0)
+            return;
+
+        // keep answering while another cpu holds the request, it might be waiting for this one with interrupts off
+        while (__atomic_test_and_set(&shootdown_busy, __ATOMIC_ACQUIRE)) {
+            answer_shootdown();
+            asm volatile("pause");
+        }
+        shootdown_request.start = start;
+        shootdown_request.end = end;
+        __atomic_store_n(&shootdown_request.pending, targets, __ATOMIC_RELEASE);
+        for (usize cpu = 0; cpu < cpu::max_cpus; cpu++) {
+            if (targets & ((u64)1 << cpu))
+                cpu::interrupts::LAPIC::send_ipi(cpu::lapic_id(cpu), shootdown_vector);
+        }
+        __atomic_add_fetch(&shootdowns_sent, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&shootdown_request.pending, __ATOMIC_ACQUIRE))
+            asm volatile("pause");
+        __atomic_clear(&shootdown_busy, __ATOMIC_RELEASE);
+    }
+
+    void init_shootdown() {
+        u8 vector = cpu::interrupts::allocate_vector();
+        cpu::interrupts::load_idt_handler(vector, shootdown_handler);
+        klib::spin_hook = answer_shootdown;
+        __atomic_store_n(&shootdown_vector, vector, __ATOMIC_RELEASE);
+    }
+
+    void print_tlb_stats() {
+        klib::printf("TLB shootdowns: %ld sent, %ld received\n",
+            __atomic_load_n(&shootdowns_sent, __ATOMIC_RELAXED), __atomic_load_n(&shootdowns_received, __ATOMIC_RELAXED));
+    }
+
+    // invalidates [start, end) of a pagemap that isnt loaded on the calling cpu, which reclaim and the merge thread
+    // change all the time, invlpg and cr3 reloads only reach the loaded pcid, returns false if the caller has to
+    // leave it to the next activate() instead, which drops every entry of the pcid
+    static bool flush_other_pcid(Pagemap *pagemap, uptr start, uptr end) {
+        if (!pcid_supported)
+            return true; // activate() always flushes
+        if (!invpcid_supported || (end - start) / 0x1000 > invlpg_threshold)
+            return false;
+        klib::LockGuard pcid_guard(pcid_lock);
+        if (pagemap->pcid_generation != current_pcid_generation)
+            return true; // it gets a new pcid, and this cpu flushes everything before it uses this generation's pcids
+        for (uptr virt = start; virt < end; virt += 0x1000)
+            cpu::invpcid_address(pagemap->pcid, virt);
+        return true;
+    }
+
+    // collects the pages whose translation changed during one operation so they can be invalidated together,
+    // locally and with a single ipi per cpu that might cache them
+    struct TlbBatch {
+        Pagemap *pagemap;
+        uptr start = ~(uptr)0, end = 0;
+
+        explicit TlbBatch(Pagemap *pagemap) : pagemap(pagemap) {}
 
-        current_table = page_table_next_level(current_table, (virt >> 39) & 0x1FF);
-        current_table = page_table_next_level(current_table, (virt >> 30) & 0x1FF);
-        current_table = page_table_next_level(current_table, (virt >> 21) & 0x1FF);
+        void add(uptr virt, usize size) {
+            start = klib::min(start, virt);
+            end = klib::max(end, virt + size);
+        }
 
-        u64 *entry = &current_table[virt >> 12 & 0x1FF];
-        bool replaced = *entry != 0;
-        *entry = (phy & 0x000FFFFFFFFFF000) | flags;
-        if (replaced) cpu::invlpg((void*)virt); // TODO: find a better way to do this crap
+        // the caller holds a lock, so this cpu cant switch pagemaps in between
+        void flush() {
+            if (start >= end)
+                return;
+            bool flushed_here;
+            if (end > kernel_half || active_pagemaps[cpu::current_cpu_number()] == pagemap) {
+                flush_local(start, end);
+                flushed_here = true;
+            } else {
+                flushed_here = flush_other_pcid(pagemap, start, end);
+            }
+            shootdown(pagemap, start, end, flushed_here);
+        }
+    };
+
+    // the lock must be held
+    static void set_mapping(u64 *pml4, uptr phy, uptr virt, u64 flags, usize page_size, TlbBatch &batch) {
+        u64 *entry = walk(pml4, virt, page_size);
+        u64 old_entry = *entry;
+        if (page_size == 0x1000) {
+            *entry = (phy & phy_mask) | flags;
+        } else {
+            *entry = (phy & phy_mask) | huge_page_flags(flags);
+            if ((old_entry & PAGE_PRESENT) && !(old_entry & PAGE_HUGE)) // a table of smaller pages is being replaced
+                free_page_table((u64*)((old_entry & phy_mask) + hhdm), page_size == giant_page_size ? 2 : 1);
+        }
+        if (old_entry != 0)
+            batch.add(virt, page_size);
+    }
+
+    void Pagemap::map_page(uptr phy, uptr virt, u64 flags, usize page_size) {
+        klib::LockGuard guard(this->lock);
+        // klib::printf("Phy: %#lX, Virt: %#lX, Flags: %#lX\n", phy, virt, flags);
+        TlbBatch batch(this);
+        set_mapping(this->pml4, phy, virt, flags, page_size, batch);
+        batch.flush();
     }
 
     void Pagemap::map_pages(uptr phy, uptr virt, usize size, u64 flags) {
-        usize num_pages = klib::align_up<usize, 0x1000>(size) / 0x1000;
-        // klib::printf("Mapping %ld pages phy %#lX virt %#lX end %#lX\n", num_pages, phy, virt, phy + num_pages * 0x1000);
-        for (usize i = 0; i < num_pages; i++)
-            map_page(phy + (i * 0x1000), virt + (i * 0x1000), flags);
+        klib::LockGuard guard(this->lock);
+        TlbBatch batch(this);
+        uptr end = virt + klib::align_up<usize, 0x1000>(size);
+        // klib::printf("Mapping phy %#lX virt %#lX end %#lX\n", phy, virt, end);
+        while (virt < end) {
+            usize page_size = 0x1000;
+            if (giant_pages_supported && !(phy % giant_page_size) && !(virt % giant_page_size) && end - virt >= giant_page_size)
+                page_size = giant_page_size;
+            else if (!(phy % huge_page_size) && !(virt % huge_page_size) && end - virt >= huge_page_size)
+                page_size = huge_page_size;
+
+            if (page_size != 0x1000) {
+                set_mapping(this->pml4, phy, virt, flags, page_size, batch);
+                phy += page_size;
+                virt += page_size;
+                continue;
+            }
+
+            // walk once and fill the rest of this page table directly
+            u64 *entry = walk(this->pml4, virt, 0x1000);
+            uptr table_end = klib::min(end, (virt & ~(huge_page_size - 1)) + huge_page_size);
+            for (; virt < table_end; virt += 0x1000, phy += 0x1000, entry++) {
+                if (*entry != 0)
+                    batch.add(virt, 0x1000);
+                *entry = (phy & phy_mask) | flags;
+            }
+        }
+        batch.flush();
+    }
+
+    // pages that lost their last mapping, freed only after the tlb batch flushed so that no cpu can reach them anymore
+    struct FreedPages {
+        klib::ListHead pages;
+        usize count = 0;
+
+        FreedPages() {
+            pages.init();
+        }
+
+        void add(uptr phy) {
+            pages.add(&pmm::phy_to_page(phy)->list);
+            count++;
+        }
+
+        void release() {
+            while (!pages.empty()) {
+                klib::ListHead *entry = pages.next;
+                entry->remove();
+                pmm::free_pages(pmm::page_to_phy(LIST_ENTRY(entry, pmm::Page, list)), 1);
+            }
+        }
+    };
+
+    // clears every mapping in [virt, end) and drops a reference to the pages, the lock must be held
+    static void clear_mappings(u64 *pml4, uptr virt, uptr end, TlbBatch &batch, FreedPages &freed) {
+        while (virt < end) {
+            // find whatever maps virt without creating any tables
+            u64 *table = pml4, *entry;
+            usize level = 3;
+            while (true) {
+                entry = &table[(virt >> level_shift(level)) & 0x1FF];
+                if (!(*entry & PAGE_PRESENT) || level == 0 || (*entry & PAGE_HUGE))
+                    break;
+                table = (u64*)((*entry & phy_mask) + hhdm);
+                level--;
+            }
+
+            usize entry_size = level_page_size(level);
+            uptr next = (virt & ~(entry_size - 1)) + entry_size;
+            if (!(*entry & PAGE_PRESENT)) { // nothing is mapped in the whole area of this entry
+                if (*entry & PAGE_SWAP) {
+                    swap::release((*entry & phy_mask) >> 12);
+                    *entry = 0;
+                }
+                virt = next;
+                continue;
+            }
+            if (level > 0 && (virt % entry_size || next > end)) { // only part of a huge page goes away
+                split_huge_page(entry, level);
+                continue;
+            }
+
+            uptr phy = *entry & phy_mask & ~(entry_size - 1);
+            if (phy != zero_page) {
+                for (usize offset = 0; offset < entry_size; offset += 0x1000)
+                    if (pmm::put_page(phy + offset))
+                        freed.add(phy + offset);
+            }
+            *entry = 0;
+            batch.add(virt, entry_size);
+            virt = next;
+        }
+    }
+
+    // frees the tables below a table at the given level that dont map anything in [start, end) anymore,
+    // returns true if the table itself became empty, the lock must be held
+    static bool prune_page_tables(u64 *table, usize level, uptr table_base, uptr start, uptr end, TlbBatch &batch, FreedPages &freed) {
+        usize entry_size = level_page_size(level);
+        usize first = start > table_base ? (start - table_base) / entry_size : 0;
+        usize last = klib::min<usize>((end - 1 - table_base) / entry_size, 511);
+        for (usize i = first; i <= last; i++) {
+            if (level == 0 || !(table[i] & PAGE_PRESENT) || (table[i] & PAGE_HUGE))
+                continue;
+            u64 *child = (u64*)((table[i] & phy_mask) + hhdm);
+            uptr child_base = table_base + i * entry_size;
+            if (prune_page_tables(child, level - 1, child_base, start, end, batch, freed)) {
+                table[i] = 0;
+                freed.add(uptr(child) - hhdm);
+                batch.add(child_base, 0x1000); // any invlpg drops the paging structure caches of the pcid
+            }
+        }
+        for (usize i = 0; i < 512; i++)
+            if (table[i] != 0)
+                return false;
+        return true;
+    }
+
+    // returns the number of pages that went back to the pmm, the lock must be held
+    static usize unmap_area(Pagemap *pagemap, uptr virt, uptr end) {
+        TlbBatch batch(pagemap);
+        FreedPages freed;
+        clear_mappings(pagemap->pml4, virt, end, batch, freed);
+        if (end <= user_half_end) // the kernel half tables are shared with every pagemap
+            prune_page_tables(pagemap->pml4, 3, 0, virt, end, batch, freed);
+        batch.flush();
+        freed.release();
+        return freed.count;
+    }
+
+    void Pagemap::unmap_pages(uptr virt, usize size) {
+        klib::LockGuard guard(this->lock);
+        unmap_area(this, virt, virt + klib::align_up<usize, 0x1000>(size));
+    }
+
+    bool Pagemap::try_unmap_pages(uptr virt, usize size, usize *freed) {
+        if (!this->lock.try_lock())
+            return false;
+        *freed = unmap_area(this, virt, virt + klib::align_up<usize, 0x1000>(size));
+        this->lock.unlock();
+        return true;
     }
 
     void Pagemap::map_kernel() {
@@ -151,68 +556,480 @@ namespace mem::vmm {
         //     if (pml4[i] != 0) { is_pagemap_empty = false; break; }
         // if (is_pagemap_empty)
         //     panic("Tried to activate pagemap %#lX (pml4: %#lX) but its completely empty", (uptr)this, (uptr)pml4);
-        cpu::write_cr3(uptr(pml4) - hhdm);
+        klib::InterruptGuard guard;
+        usize cpu = cpu::current_cpu_number();
+        if (active_pagemaps[cpu] == this)
+            return; // nothing to flush, the kernel half is global anyway
+        u64 self = (u64)1 << cpu;
+        if (active_pagemaps[cpu])
+            __atomic_and_fetch(&active_pagemaps[cpu]->active_cpus, ~self, __ATOMIC_SEQ_CST);
+        active_pagemaps[cpu] = this;
+        __atomic_or_fetch(&this->active_cpus, self, __ATOMIC_SEQ_CST);
+
+        if (!pcid_supported) {
+            cpu::write_cr3(uptr(pml4) - hhdm);
+            return;
+        }
+
+        // a shootdown happened while this cpu ran something else, the entries it kept for the pcid are stale
+        bool flush_pcid = __atomic_fetch_and(&this->stale_cpus, ~self, __ATOMIC_SEQ_CST) & self;
+        bool flush = false;
+        {
+            klib::LockGuard pcid_guard(pcid_lock);
+            if (this != &kernel_pagemap && this->pcid_generation != current_pcid_generation) {
+                if (next_pcid == max_pcids) {
+                    next_pcid = 1;
+                    current_pcid_generation++;
+                }
+                this->pcid = next_pcid++;
+                this->pcid_generation = current_pcid_generation;
+            }
+            if (cpu_pcid_generations[cpu] != current_pcid_generation) {
+                cpu_pcid_generations[cpu] = current_pcid_generation; // this cpu might still have entries of pcids that were handed out again
+                flush = true;
+            }
+        }
+
+        u64 keep_entries = flush_pcid ? 0 : (u64)1 << 63; // bit 63 keeps the entries tagged with the pcid
+        cpu::write_cr3((uptr(pml4) - hhdm) | pcid | keep_entries);
+        if (flush)
+            cpu::flush_tlb_all();
     }
 
+    // returns the physical address of the 4 KiB page containing virt, or 0 if it is not mapped
     uptr Pagemap::physical_addr(uptr virt) {
         u64 *current_table = pml4;
+        for (usize level = 3; ; level--) {
+            u64 entry = current_table[(virt >> level_shift(level)) & 0x1FF];
+            if (!(entry & PAGE_PRESENT))
+                return 0;
+            if (level == 0 || (entry & PAGE_HUGE)) {
+                uptr base = entry & phy_mask & ~(level_page_size(level) - 1);
+                return base + (virt & (level_page_size(level) - 1) & ~(uptr)0xFFF);
+            }
+            current_table = (u64*)((entry & phy_mask) + hhdm);
+        }
+    }
 
-        // TODO: make these not allocate if they cant find
-        current_table = page_table_next_level(current_table, (virt >> 39) & 0x1FF);
-        current_table = page_table_next_level(current_table, (virt >> 30) & 0x1FF);
-        current_table = page_table_next_level(current_table, (virt >> 21) & 0x1FF);
+    static MappedRange* range_at_or_above(Pagemap *pagemap, uptr virt);
 
-        u64 *entry = &current_table[virt >> 12 & 0x1FF];
-        return *entry & 0x000FFFFFFFFFF000;
+    void Pagemap::add_range(MappedRange *range) {
+        klib::LockGuard guard(this->lock);
+        // every lookup assumes a page belongs to at most one range
+        MappedRange *next = range_at_or_above(this, range->base);
+        ASSERT(addr_to_range(range->base) == nullptr && (next == nullptr || next->base >= range->base + range->length));
+        range_tree.insert(&range->range_node);
     }
 
-    // TODO: maybe optimize somehow
+    // the lock must be held
     MappedRange* Pagemap::addr_to_range(uptr virt) {
-        klib::ListHead *current = &this->range_list_head;
-        while (true) {
-            if (current->next == &this->range_list_head)
+        // faults tend to walk through the same range
+        if (last_range && virt >= last_range->base && virt < last_range->base + last_range->length)
+            return last_range;
+
+        klib::AVLNode *node = range_tree.root;
+        while (node) {
+            // if any range in the left subtree ends above virt then the left subtree is the only place virt can be
+            if (node->left && (AVL_ENTRY(node->left, MappedRange, range_node))->subtree_end > virt) {
+                node = node->left;
+                continue;
+            }
+            MappedRange *range = AVL_ENTRY(node, MappedRange, range_node);
+            if (virt < range->base)
                 return nullptr;
-            current = current->next;
-            MappedRange *range = LIST_ENTRY(current, MappedRange, range_list);
-            if (virt >= range->base && virt <= range->base + range->length)
+            if (virt < range->base + range->length) {
+                last_range = range;
                 return range;
+            }
+            node = node->right;
+        }
+        return nullptr;
+    }
+
+    // returns the entry for a page of the range that was never touched, or 0 if the range type is unknown
+    static u64 populate_page(MappedRange *range, uptr page, bool write) {
+        switch (range->type) {
+        case MappedRange::Type::FILE: {
+            usize offset = page - range->base;
+            if (offset < range->file_size) {
+                usize count = klib::min<usize>(range->file_size - offset, 0x1000);
+                // whole file pages are shared through the page cache, writable ones get their own copy on the first write
+                if (count == 0x1000 && !(write && (range->page_flags & PAGE_WRITABLE))) {
+                    uptr cached = page_cache::get_page(range->file, range->file_offset + offset);
+                    if (range->page_flags & PAGE_WRITABLE)
+                        return cached | (range->page_flags & ~(u64)PAGE_WRITABLE) | PAGE_COW;
+                    return cached | range->page_flags;
+                }
+                uptr new_page = pmm::alloc_pages(1, count < 0x1000 ? (u32)pmm::ALLOC_ZEROED : 0);
+                fs::vfs::FileNode *file = range->file;
+                file->fs->read(file->fs, file, (void*)(new_page + hhdm), count, range->file_offset + offset);
+                return new_page | range->page_flags;
+            }
+            [[fallthrough]]; // the bss tail is plain anonymous memory
+        }
+        case MappedRange::Type::ANONYMOUS: {
+            if (!write) // reads get the zero page until the first write
+                return zero_page | (range->page_flags & ~(u64)PAGE_WRITABLE);
+            // allocate a new page
+            uptr new_page = pmm::alloc_pages(1, pmm::ALLOC_ZEROED);
+            return new_page | range->page_flags;
+        }
+        case MappedRange::Type::DIRECT:
+            return ((page - hhdm) & phy_mask) | range->page_flags;
+        default:
+            klib::printf("Unknown mapped range type: %#lX\n", u64(range->type));
+            return 0;
+        }
+    }
+
+    // the number of pages to populate on a fault, it doubles while faults land right after the previous window
+    static usize fault_around_window(Pagemap *pagemap, uptr page) {
+        if (page == pagemap->fault_around_next)
+            pagemap->fault_around_pages = klib::min(pagemap->fault_around_pages * 2, klib::max<usize>(fault_around_max_pages, 1));
+        else
+            pagemap->fault_around_pages = 1;
+        return pagemap->fault_around_pages;
+    }
+
+    // user anonymous ranges at least this large get 2 MiB pages where a whole aligned window fits inside them
+    static bool huge_page_eligible(MappedRange *range, uptr virt) {
+        if (range->type != MappedRange::Type::ANONYMOUS || !(range->page_flags & PAGE_USER) || range->length < huge_page_min_range)
+            return false;
+        uptr window = virt & ~(huge_page_size - 1);
+        return window >= range->base && window + huge_page_size <= range->base + range->length;
+    }
+
+    // returns the entry that maps virt and sets level to its level, or nullptr if nothing maps it
+    static u64* find_entry(u64 *pml4, uptr virt, usize *level) {
+        u64 *current_table = pml4;
+        for (usize current = 3; ; current--) {
+            u64 *entry = &current_table[(virt >> level_shift(current)) & 0x1FF];
+            if (!(*entry & PAGE_PRESENT))
+                return nullptr;
+            if (current == 0 || (*entry & PAGE_HUGE)) {
+                *level = current;
+                return entry;
+            }
+            current_table = (u64*)((*entry & phy_mask) + hhdm);
         }
     }
 
+    // the lock must be held
+    static void copy_on_write(Pagemap *pagemap, uptr virt, usize level) {
+        uptr page = virt & ~(uptr)0xFFF;
+        u64 *entry = walk(pagemap->pml4, page, 0x1000); // splits a shared huge page, its subpages were all referenced by fork
+        uptr phy = *entry & phy_mask;
+        u64 flags = (*entry & ~phy_mask & ~(u64)PAGE_COW) | PAGE_WRITABLE | PAGE_ACCESSED;
+
+        if (pmm::page_refcount(phy) == 1) {
+            *entry = phy | flags; // every other pagemap already let go of the page
+        } else {
+            if (pmm::phy_to_page(phy)->flags & pmm::Page::MERGED)
+                page_merge::count_unmerge();
+            uptr new_page = pmm::alloc_pages(1);
+            klib::memcpy((void*)(new_page + hhdm), (void*)(phy + hhdm), 0x1000);
+            *entry = new_page | flags;
+            pmm::unref_page(phy);
+        }
+
+        TlbBatch batch(pagemap);
+        if (level == 0)
+            batch.add(page, 0x1000);
+        else
+            batch.add(page & ~(level_page_size(level) - 1), level_page_size(level)); // the huge translation has to go too
+        batch.flush();
+    }
+
+    // false if the entry doesnt allow the access, otherwise the fault came from a stale tlb entry and is already resolved
+    static bool entry_allows(u64 entry, u64 error) {
+        if (!(entry & PAGE_PRESENT) || (error & PAGE_FAULT_RESERVED))
+            return false;
+        if ((error & PAGE_FAULT_WRITE) && !(entry & PAGE_WRITABLE))
+            return false;
+        if ((error & PAGE_FAULT_USER) && !(entry & PAGE_USER))
+            return false;
+        if ((error & PAGE_FAULT_FETCH) && (entry & PAGE_NO_EXECUTE))
+            return false;
+        return true;
+    }
+
     // returns true if the page fault couldnt be handled
-    bool Pagemap::handle_page_fault(uptr virt) {
+    bool Pagemap::handle_page_fault(uptr virt, u64 error) {
         klib::LockGuard guard(this->lock);
-        u64 *current_table = this->pml4;
+        usize cpu = cpu::current_cpu_number();
+        Pagemap *previous = faulting_pagemaps[cpu];
+        uptr previous_window = faulting_windows[cpu];
+        faulting_pagemaps[cpu] = this;
+        faulting_windows[cpu] = virt & ~(huge_page_size - 1);
+        bool failed = resolve_page_fault(virt, error);
+        faulting_pagemaps[cpu] = previous;
+        faulting_windows[cpu] = previous_window;
+        return failed;
+    }
 
-        current_table = page_table_next_level(current_table, (virt >> 39) & 0x1FF);
-        current_table = page_table_next_level(current_table, (virt >> 30) & 0x1FF);
-        current_table = page_table_next_level(current_table, (virt >> 21) & 0x1FF);
+    bool Pagemap::resolve_page_fault(uptr virt, u64 error) {
+        bool write = error & PAGE_FAULT_WRITE;
+        MappedRange *range = addr_to_range(virt);
+        if (range && (error & PAGE_FAULT_USER) && !(range->page_flags & PAGE_USER))
+            return true; // PROT_NONE
+        if (range && write && !(range->page_flags & PAGE_WRITABLE))
+            return true;
 
-        u64 *entry = &current_table[virt >> 12 & 0x1FF];
+        if ((error & PAGE_FAULT_PRESENT) && write) {
+            usize level;
+            u64 *entry = find_entry(this->pml4, virt, &level);
+            if (entry && (*entry & PAGE_COW)) {
+                copy_on_write(this, virt, level);
+                return false;
+            }
+        }
 
-        if (!(*entry & PAGE_PRESENT)) {
-            MappedRange *range = addr_to_range(virt);
-            if (range == nullptr)
+        if (range == nullptr)
+            return true;
+
+        uptr page = virt & ~(uptr)0xFFF;
+
+        if (write && huge_page_eligible(range, virt)) {
+            u64 *directory_entry = walk(this->pml4, virt, huge_page_size);
+            if (*directory_entry & PAGE_HUGE) {
+                // another fault mapped the window first, or this cpu still had the entry from before it was installed
+                if (entry_allows(*directory_entry, error))
+                    return false;
+                if (*directory_entry & PAGE_COW) {
+                    copy_on_write(this, virt, 1);
+                    return false;
+                }
                 return true;
-            
-            switch (range->type) {
-            case MappedRange::Type::ANONYMOUS: {
-                // allocate a new page
-                uptr new_page = pmm::alloc_pages(1);
-                klib::memset((void*)(new_page + hhdm), 0, 0x1000);
-                *entry = new_page | range->page_flags;
+            }
+            if (*directory_entry == 0) {
+                // nothing in this window was touched yet, try to back all of it with one contiguous block
+                uptr block = pmm::try_alloc_pages(huge_page_size / 0x1000, pmm::ALLOC_ZEROED);
+                if (block) {
+                    *directory_entry = block | huge_page_flags(range->page_flags);
+                    return false;
+                }
+            }
+        }
+
+        u64 *entry = walk(this->pml4, virt, 0x1000);
+        if (*entry & PAGE_PRESENT) {
+            // the first write to a page that was only read so far, give it its own copy of the zero page
+            if (write && (*entry & phy_mask) == zero_page && (range->page_flags & PAGE_WRITABLE)) {
+                uptr new_page = pmm::alloc_pages(1, pmm::ALLOC_ZEROED);
+                *entry = new_page | range->page_flags | PAGE_ACCESSED;
+                TlbBatch batch(this);
+                batch.add(page, 0x1000);
+                batch.flush();
                 return false;
             }
-            case MappedRange::Type::DIRECT:
-                *entry = ((virt - hhdm) & 0x000FFFFFFFFFF000) | range->page_flags;
+            if (write && (*entry & PAGE_COW)) {
+                copy_on_write(this, virt, 0);
                 return false;
-            default:
-                klib::printf("Unknown mapped range type: %#lX\n", u64(range->type));
-                return true;
             }
-        } else return true;
+            return !entry_allows(*entry, error);
+        }
+
+        if (*entry & PAGE_SWAP) { // reclaimed earlier, decompress it into a new page
+            u64 handle = (*entry & phy_mask) >> 12;
+            uptr new_page = pmm::alloc_pages(1);
+            swap::load(handle, (void*)(new_page + hhdm));
+            swap::release(handle);
+            *entry = new_page | range->page_flags | PAGE_ACCESSED;
+            return false;
+        }
+
+        // new entries start out accessed, or a reclaim from inside this fault would take them right back out
+        u64 new_entry = populate_page(range, page, write);
+        if (new_entry == 0)
+            return true;
+        *entry = new_entry | PAGE_ACCESSED;
+
+        // fault around: populate the following untouched pages of the range that share this page table
+        uptr window_end = page + fault_around_window(this, page) * 0x1000;
+        window_end = klib::min(window_end, range->base + range->length);
+        window_end = klib::min(window_end, (page & ~(huge_page_size - 1)) + huge_page_size);
+        for (uptr current = page + 0x1000; current < window_end; current += 0x1000) {
+            entry++;
+            if (*entry != 0)
+                continue;
+            if (u64 around_entry = populate_page(range, current, write))
+                *entry = around_entry | PAGE_ACCESSED;
+        }
+        fault_around_next = klib::max(window_end, page + 0x1000);
+        return false;
     }
     
+    // gives the child its own copy of a page in the swap store, the lock must be held
+    static u64 fork_swap_entry(Pagemap *parent, u64 entry, uptr virt) {
+        u64 copy;
+        if (swap::duplicate((entry & phy_mask) >> 12, &copy))
+            return (copy << 12) | PAGE_SWAP;
+
+        // the store is full, the child gets the page decompressed instead
+        MappedRange *range = parent->addr_to_range(virt);
+        uptr page = pmm::alloc_pages(1);
+        swap::load((entry & phy_mask) >> 12, (void*)(page + hhdm));
+        return page | (range ? range->page_flags : PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE | PAGE_NO_EXECUTE);
+    }
+
+    // copies the tables below a table at the given level and shares every page they map, the lock must be held
+    static void fork_page_table(Pagemap *parent_map, u64 *parent, u64 *child, usize level, uptr base) {
+        for (usize i = 0; i < 512; i++) {
+            u64 entry = parent[i];
+            if (!(entry & PAGE_PRESENT)) {
+                child[i] = (entry & PAGE_SWAP) ? fork_swap_entry(parent_map, entry, base + i * level_page_size(level)) : 0;
+                continue;
+            }
+
+            if (level > 0 && !(entry & PAGE_HUGE)) {
+                u64 *child_table = new_page_table();
+                fork_page_table(parent_map, (u64*)((entry & phy_mask) + hhdm), child_table, level - 1, base + i * level_page_size(level));
+                child[i] = (uptr(child_table) - hhdm) | (entry & ~phy_mask);
+                continue;
+            }
+
+            uptr phy = entry & phy_mask & ~(level_page_size(level) - 1);
+            if (phy == zero_page) { // already read only and never freed
+                child[i] = entry;
+                continue;
+            }
+            if (entry & PAGE_WRITABLE) {
+                entry = (entry & ~(u64)PAGE_WRITABLE) | PAGE_COW;
+                parent[i] = entry;
+            }
+            for (usize offset = 0; offset < level_page_size(level); offset += 0x1000)
+                pmm::ref_page(phy + offset);
+            child[i] = entry;
+        }
+    }
+
+    Pagemap* Pagemap::fork() {
+        Pagemap *child = new_user_pagemap();
+        klib::LockGuard child_guard(child->lock); // reclaim might already look at it
+
+        klib::LockGuard guard(this->lock);
+        for (usize i = 0; i < 256; i++) {
+            u64 entry = this->pml4[i];
+            if (!(entry & PAGE_PRESENT))
+                continue;
+            u64 *child_table = new_page_table();
+            fork_page_table(this, (u64*)((entry & phy_mask) + hhdm), child_table, 2, i * level_page_size(3));
+            child->pml4[i] = (uptr(child_table) - hhdm) | (entry & ~phy_mask);
+        }
+
+        for (klib::AVLNode *node = range_tree.first(); node; node = range_tree.next(node)) {
+            MappedRange *range = new MappedRange(*AVL_ENTRY(node, MappedRange, range_node));
+            child->range_tree.insert(&range->range_node);
+        }
+
+        // the parent lost write access to its pages
+        TlbBatch batch(this);
+        batch.add(0, user_half_end);
+        batch.flush();
+        return child;
+    }
+
+    // the first range that starts at or above virt, the lock must be held
+    static MappedRange* range_at_or_above(Pagemap *pagemap, uptr virt) {
+        klib::AVLNode *node = pagemap->range_tree.root, *found = nullptr;
+        while (node) {
+            if ((AVL_ENTRY(node, MappedRange, range_node))->base >= virt) {
+                found = node;
+                node = node->left;
+            } else {
+                node = node->right;
+            }
+        }
+        return found ? AVL_ENTRY(found, MappedRange, range_node) : nullptr;
+    }
+
+    // makes virt the boundary between two ranges if a range runs across it, the lock must be held
+    static void split_range(Pagemap *pagemap, uptr virt) {
+        MappedRange *range = pagemap->addr_to_range(virt);
+        if (range == nullptr || range->base == virt)
+            return;
+        MappedRange *tail = new MappedRange(*range);
+        tail->base = virt;
+        tail->length = range->base + range->length - virt;
+        if (range->type == MappedRange::Type::FILE) {
+            usize cut = virt - range->base;
+            tail->file_offset += cut;
+            tail->file_size = range->file_size > cut ? range->file_size - cut : 0;
+        }
+        pagemap->range_tree.remove(&range->range_node);
+        range->length = virt - range->base;
+        pagemap->range_tree.insert(&range->range_node);
+        pagemap->range_tree.insert(&tail->range_node);
+    }
+
+    // first fit search for length bytes that no range covers, at or above floor, returns 0 if there are none
+    static uptr find_free_area(Pagemap *pagemap, uptr floor, usize length, usize align) {
+        uptr candidate = floor;
+        if (MappedRange *range = pagemap->addr_to_range(floor))
+            candidate = range->base + range->length;
+        candidate = (candidate + align - 1) & ~(align - 1);
+
+        for (MappedRange *range = range_at_or_above(pagemap, candidate); range; ) {
+            if (range->base >= candidate + length)
+                break;
+            candidate = klib::max(candidate, (range->base + range->length + align - 1) & ~(align - 1));
+            klib::AVLNode *next = pagemap->range_tree.next(&range->range_node);
+            range = next ? AVL_ENTRY(next, MappedRange, range_node) : nullptr;
+        }
+        if (candidate + length > user_half_end)
+            return 0;
+        return candidate;
+    }
+
+    // PROT_NONE keeps the pages present but takes them away from user mode
+    static u64 prot_to_page_flags(int prot) {
+        u64 page_flags = PAGE_PRESENT;
+        if (prot != PROT_NONE)
+            page_flags |= PAGE_USER;
+        if (prot & PROT_WRITE)
+            page_flags |= PAGE_WRITABLE;
+        if (!(prot & PROT_EXEC))
+            page_flags |= PAGE_NO_EXECUTE;
+        return page_flags;
+    }
+
+    // applies new range flags to the pages mapped in [virt, end), the lock must be held
+    static void protect_mappings(u64 *pml4, uptr virt, uptr end, u64 page_flags, TlbBatch &batch) {
+        while (virt < end) {
+            u64 *table = pml4, *entry;
+            usize level = 3;
+            while (true) {
+                entry = &table[(virt >> level_shift(level)) & 0x1FF];
+                if (!(*entry & PAGE_PRESENT) || level == 0 || (*entry & PAGE_HUGE))
+                    break;
+                table = (u64*)((*entry & phy_mask) + hhdm);
+                level--;
+            }
+
+            usize entry_size = level_page_size(level);
+            uptr next = (virt & ~(entry_size - 1)) + entry_size;
+            if (!(*entry & PAGE_PRESENT)) {
+                virt = next;
+                continue;
+            }
+            if (level > 0 && (virt % entry_size || next > end)) {
+                split_huge_page(entry, level);
+                continue;
+            }
+
+            uptr phy = *entry & phy_mask & ~(entry_size - 1);
+            u64 flags = page_flags | (*entry & (PAGE_ACCESSED | PAGE_DIRTY | PAGE_COW));
+            if (phy == zero_page) {
+                flags &= ~(u64)PAGE_WRITABLE; // the first write still has to allocate a page
+            } else if ((flags & PAGE_WRITABLE) && ((flags & PAGE_COW) || pmm::page_refcount(phy) > 1)) {
+                flags = (flags & ~(u64)PAGE_WRITABLE) | PAGE_COW; // shared pages become writable through a copy
+            }
+            *entry = phy | (level > 0 ? huge_page_flags(flags) : flags);
+            batch.add(virt, entry_size);
+            virt = next;
+        }
+    }
+
     isize syscall_mmap(void *hint, usize length, int prot, int flags, int fd, usize offset) {
 #if SYSCALL_TRACE
         klib::printf("mmap(%#lX, %ld, %d, %d, %d, %ld)\n", (uptr)hint, length, prot, flags, fd, offset);
@@ -220,24 +1037,429 @@ namespace mem::vmm {
         auto *task = (sched::Task*)cpu::read_gs_base();
         if (!(flags & MAP_PRIVATE) || (flags & MAP_SHARED) || !(flags & MAP_ANONYMOUS))
             return -ENOSYS; // only private anonymous mapping is supported
-        
-        u64 page_flags = PAGE_PRESENT | PAGE_USER;
-        if (prot & PROT_WRITE)
-            page_flags |= PAGE_WRITABLE;
-        if (!(prot & PROT_EXEC))
-            page_flags |= PAGE_NO_EXECUTE;
-        
-        uptr base = task->mmap_anon_base;
+        if (length == 0 || length > user_half_end)
+            return -EINVAL;
+
         usize aligned_size = klib::align_up<usize, 0x1000>(length);
+        // give large ranges as many aligned 2 MiB windows as possible
+        usize align = aligned_size >= huge_page_min_range ? huge_page_size : 0x1000;
+
+        Pagemap *pagemap = task->pagemap;
+        klib::LockGuard guard(pagemap->lock);
+        uptr base = (uptr)hint;
+        if (base % 0x1000 || base < task->mmap_anon_base || find_free_area(pagemap, base, aligned_size, 0x1000) != base)
+            base = find_free_area(pagemap, task->mmap_anon_base, aligned_size, align);
+        if (base == 0)
+            return -ENOMEM;
 
         MappedRange *range = new MappedRange();
         range->base = base;
         range->length = aligned_size;
-        range->page_flags = page_flags;
+        range->page_flags = prot_to_page_flags(prot);
         range->type = MappedRange::Type::ANONYMOUS;
-        task->pagemap->range_list_head.add(&range->range_list);
-
-        task->mmap_anon_base += aligned_size;
+        pagemap->range_tree.insert(&range->range_node);
         return base;
     }
+
+    isize syscall_munmap(void *addr, usize length) {
+#if SYSCALL_TRACE
+        klib::printf("munmap(%#lX, %ld)\n", (uptr)addr, length);
+#endif
+        auto *task = (sched::Task*)cpu::read_gs_base();
+        uptr base = (uptr)addr;
+        if (base % 0x1000 || length == 0 || base >= user_half_end || length > user_half_end - base)
+            return -EINVAL;
+        uptr end = base + klib::align_up<usize, 0x1000>(length);
+
+        Pagemap *pagemap = task->pagemap;
+        klib::LockGuard guard(pagemap->lock);
+        split_range(pagemap, base);
+        split_range(pagemap, end);
+        while (MappedRange *range = range_at_or_above(pagemap, base)) {
+            if (range->base >= end)
+                break;
+            pagemap->range_tree.remove(&range->range_node);
+            delete range;
+        }
+        pagemap->last_range = nullptr;
+        unmap_area(pagemap, base, end);
+        return 0;
+    }
+
+    isize syscall_mprotect(void *addr, usize length, int prot) {
+#if SYSCALL_TRACE
+        klib::printf("mprotect(%#lX, %ld, %d)\n", (uptr)addr, length, prot);
+#endif
+        auto *task = (sched::Task*)cpu::read_gs_base();
+        uptr base = (uptr)addr;
+        if (base % 0x1000 || base >= user_half_end || length > user_half_end - base)
+            return -EINVAL;
+        uptr end = base + klib::align_up<usize, 0x1000>(length);
+
+        Pagemap *pagemap = task->pagemap;
+        klib::LockGuard guard(pagemap->lock);
+        for (uptr virt = base; virt < end; ) { // the whole area has to be mapped
+            MappedRange *range = pagemap->addr_to_range(virt);
+            if (range == nullptr)
+                return -ENOMEM;
+            virt = range->base + range->length;
+        }
+
+        u64 page_flags = prot_to_page_flags(prot);
+        split_range(pagemap, base);
+        split_range(pagemap, end);
+        for (MappedRange *range = range_at_or_above(pagemap, base); range && range->base < end; ) {
+            range->page_flags = page_flags;
+            klib::AVLNode *next = pagemap->range_tree.next(&range->range_node);
+            range = next ? AVL_ENTRY(next, MappedRange, range_node) : nullptr;
+        }
+
+        TlbBatch batch(pagemap);
+        protect_mappings(pagemap->pml4, base, end, page_flags, batch);
+        batch.flush();
+        return 0;
+    }
+
+    isize syscall_madvise(void *addr, usize length, int advice) {
+#if SYSCALL_TRACE
+        klib::printf("madvise(%#lX, %ld, %d)\n", (uptr)addr, length, advice);
+#endif
+        auto *task = (sched::Task*)cpu::read_gs_base();
+        uptr base = (uptr)addr;
+        if (base % 0x1000 || base >= user_half_end || length > user_half_end - base)
+            return -EINVAL;
+        if (advice != MADV_MERGEABLE && advice != MADV_UNMERGEABLE)
+            return -EINVAL;
+        uptr end = base + klib::align_up<usize, 0x1000>(length);
+
+        Pagemap *pagemap = task->pagemap;
+        klib::LockGuard guard(pagemap->lock);
+        for (uptr virt = base; virt < end; ) { // the whole area has to be mapped
+            MappedRange *range = pagemap->addr_to_range(virt);
+            if (range == nullptr)
+                return -ENOMEM;
+            virt = range->base + range->length;
+        }
+
+        // pages that are already merged stay shared until they are written
+        split_range(pagemap, base);
+        split_range(pagemap, end);
+        for (MappedRange *range = range_at_or_above(pagemap, base); range && range->base < end; ) {
+            if (range->type == MappedRange::Type::ANONYMOUS)
+                range->mergeable = advice == MADV_MERGEABLE;
+            klib::AVLNode *next = pagemap->range_tree.next(&range->range_node);
+            range = next ? AVL_ENTRY(next, MappedRange, range_node) : nullptr;
+        }
+        return 0;
+    }
+
+    constexpr usize reclaim_scan_pages = 1024; // pages looked at per visit of a pagemap
+    constexpr usize reclaim_batch = 64; // pages taken out per visit
+
+    // one step of a clock through the anonymous user pages of the pagemap: pages that were accessed since the last
+    // pass only lose their accessed bit, the others are compressed into the swap store, the 2 MiB at skip are left
+    // alone (~0 for none), the lock must be held
+    static usize reclaim_from(Pagemap *pagemap, usize target, usize *scanned, uptr skip) {
+        struct Victim {
+            u64 *entry;
+            u64 old_entry;
+        } victims[reclaim_batch];
+        usize victim_count = 0, max_victims = klib::min(target, reclaim_batch);
+        TlbBatch batch(pagemap);
+
+        uptr virt = pagemap->reclaim_cursor;
+        MappedRange *range = pagemap->addr_to_range(virt);
+        if (range == nullptr)
+            range = range_at_or_above(pagemap, virt);
+        while (range && *scanned < reclaim_scan_pages && victim_count < max_victims) {
+            uptr end = range->base + range->length;
+            if (range->type == MappedRange::Type::ANONYMOUS && (range->page_flags & PAGE_USER) && end <= user_half_end) {
+                virt = klib::max(virt, range->base);
+                while (virt < end && *scanned < reclaim_scan_pages && victim_count < max_victims) {
+                    u64 *table = pagemap->pml4, *entry;
+                    usize level = 3;
+                    while (true) {
+                        entry = &table[(virt >> level_shift(level)) & 0x1FF];
+                        if (!(*entry & PAGE_PRESENT) || level == 0 || (*entry & PAGE_HUGE))
+                            break;
+                        table = (u64*)((*entry & phy_mask) + hhdm);
+                        level--;
+                    }
+                    uptr page = virt;
+                    virt = (virt & ~(level_page_size(level) - 1)) + level_page_size(level);
+                    if (!(*entry & PAGE_PRESENT) || level > 0) // huge pages stay where they are
+                        continue;
+                    if ((page & ~(huge_page_size - 1)) == skip)
+                        continue;
+
+                    (*scanned)++;
+                    uptr phy = *entry & phy_mask;
+                    if (phy == zero_page || pmm::page_refcount(phy) != 1
+                            || (pmm::phy_to_page(phy)->flags & (pmm::Page::PINNED | pmm::Page::FILE_BACKED)))
+                        continue;
+                    if (*entry & PAGE_ACCESSED) {
+                        *entry &= ~(u64)PAGE_ACCESSED;
+                        batch.add(page, 0x1000); // or the cpu wont set it again
+                        continue;
+                    }
+                    victims[victim_count++] = { entry, *entry };
+                    *entry = PAGE_SWAP; // nothing can fault on it before the real handle is in, the lock is held
+                    batch.add(page, 0x1000);
+                }
+                if (virt < end)
+                    break;
+            }
+            klib::AVLNode *next = pagemap->range_tree.next(&range->range_node);
+            range = next ? AVL_ENTRY(next, MappedRange, range_node) : nullptr;
+            virt = range ? range->base : 0;
+        }
+        pagemap->reclaim_cursor = range ? virt : 0; // start over at the end
+        batch.flush();
+
+        // no cpu can write to the victims anymore
+        usize freed = 0;
+        for (usize i = 0; i < victim_count; i++) {
+            uptr phy = victims[i].old_entry & phy_mask;
+            u64 handle;
+            if (!swap::store((void*)(phy + hhdm), &handle)) {
+                *victims[i].entry = victims[i].old_entry & ~(u64)PAGE_ACCESSED;
+                continue;
+            }
+            *victims[i].entry = (handle << 12) | PAGE_SWAP;
+            pmm::unref_page(phy);
+            freed++;
+        }
+        return freed;
+    }
+
+    // the reclaim hook of the pmm, visits the user pagemaps round robin until enough pages are free
+    // or a whole round found nothing to look at, pagemaps that are locked elsewhere are skipped
+    static usize reclaim_pages(usize target) {
+        klib::LockGuard guard(user_pagemaps_lock);
+        usize cpu = cpu::current_cpu_number();
+        usize freed = 0, idle_visits = 0;
+        for (usize visit = 0; visit < user_pagemap_count * 64 && idle_visits < user_pagemap_count && freed < target; visit++) {
+            // the visited pagemap goes to the back
+            klib::ListHead *node = user_pagemaps.next;
+            node->remove();
+            user_pagemaps.add_before(node);
+            Pagemap *pagemap = LIST_ENTRY(node, Pagemap, user_pagemaps);
+
+            usize scanned = 0;
+            if (pagemap == faulting_pagemaps[cpu]) {
+                // the pages the fault is bringing in would otherwise be the first victims, taken out as they come in
+                freed += reclaim_from(pagemap, target - freed, &scanned, faulting_windows[cpu]);
+            } else if (pagemap->lock.try_lock()) {
+                freed += reclaim_from(pagemap, target - freed, &scanned, ~(uptr)0);
+                pagemap->lock.unlock();
+            }
+            idle_visits = scanned ? 0 : idle_visits + 1;
+        }
+        return freed;
+    }
+
+    constexpr usize merge_scan_pages = 256; // pages looked at per visit of a pagemap
+    constexpr usize merge_sleep_rounds = 100; // scheduler rounds between two passes over every pagemap
+    constexpr usize merge_candidate_count = 4096;
+
+    // the first page seen with some contents waits here for a twin, a slot is only valid during the pass that filled it
+    // and only the merge thread uses them
+    struct MergeCandidate {
+        Pagemap *pagemap;
+        uptr virt;
+        u64 hash;
+        u64 pass;
+    };
+    static MergeCandidate merge_candidates[merge_candidate_count];
+    static u64 merge_pass = 1;
+    static u64 zero_page_hash;
+
+    static inline bool range_mergeable(MappedRange *range) {
+        return range->mergeable && range->type == MappedRange::Type::ANONYMOUS && (range->page_flags & PAGE_USER);
+    }
+
+    // private pages only, shared ones are either merged already or copies of a fork that copy on write takes care of
+    static inline bool page_mergeable(u64 entry) {
+        uptr phy = entry & phy_mask;
+        if (phy == zero_page || pmm::page_refcount(phy) != 1)
+            return false;
+        return !(pmm::phy_to_page(phy)->flags & (pmm::Page::PINNED | pmm::Page::FILE_BACKED));
+    }
+
+    // the entry of a page that can still be merged at virt, or nullptr, the lock must be held
+    static u64* mergeable_entry(Pagemap *pagemap, uptr virt, MappedRange **range) {
+        *range = pagemap->addr_to_range(virt);
+        if (*range == nullptr || !range_mergeable(*range))
+            return nullptr;
+        usize level;
+        u64 *entry = find_entry(pagemap->pml4, virt, &level);
+        if (entry == nullptr || level > 0 || !page_mergeable(*entry))
+            return nullptr;
+        return entry;
+    }
+
+    // merged pages are read only, a writable range copies them on the first write
+    static inline u64 shared_page_flags(MappedRange *range) {
+        if (range->page_flags & PAGE_WRITABLE)
+            return (range->page_flags & ~(u64)PAGE_WRITABLE) | PAGE_COW;
+        return range->page_flags;
+    }
+
+    // stops writes to the page so its contents can be compared, the lock must be held
+    static void write_protect(Pagemap *pagemap, u64 *entry, uptr virt) {
+        if (!(*entry & PAGE_WRITABLE))
+            return;
+        *entry = (*entry & ~(u64)PAGE_WRITABLE) | PAGE_COW; // a write now just takes the page back if it stays private
+        TlbBatch batch(pagemap);
+        batch.add(virt, 0x1000);
+        batch.flush();
+    }
+
+    // points the entry at another page and drops the old one once no cpu can reach it, the lock must be held
+    static void replace_page(Pagemap *pagemap, u64 *entry, uptr virt, u64 new_entry) {
+        uptr old_phy = *entry & phy_mask;
+        *entry = new_entry;
+        TlbBatch batch(pagemap);
+        batch.add(virt, 0x1000);
+        batch.flush();
+        pmm::unref_page(old_phy);
+    }
+
+    // tries to merge a private page with the zero page, a merged page or the candidate with the same hash,
+    // pages are only considered once their hash stayed the same for a whole pass, the lock must be held
+    static void merge_page(Pagemap *pagemap, MappedRange *range, u64 *entry, uptr virt) {
+        uptr phy = *entry & phy_mask;
+        void *data = (void*)(phy + hhdm);
+        pmm::Page *page = pmm::phy_to_page(phy);
+        u64 hash = page_merge::hash_page(data);
+        if (hash != page->owner_index) {
+            page->owner_index = hash; // written since the last pass or never seen
+            return;
+        }
+
+        if (hash == zero_page_hash) {
+            write_protect(pagemap, entry, virt);
+            if (klib::memcmp(data, (void*)(zero_page + hhdm), 0x1000) == 0) {
+                replace_page(pagemap, entry, virt, zero_page | (range->page_flags & ~(u64)PAGE_WRITABLE));
+                page_merge::count_merge(true);
+            }
+            return;
+        }
+
+        if (uptr shared = page_merge::find(data, hash)) {
+            write_protect(pagemap, entry, virt);
+            if (klib::memcmp(data, (void*)(shared + hhdm), 0x1000) == 0) {
+                replace_page(pagemap, entry, virt, shared | shared_page_flags(range));
+                page_merge::count_merge(false);
+            } else {
+                pmm::unref_page(shared); // it changed before it was write protected
+            }
+            return;
+        }
+
+        MergeCandidate &candidate = merge_candidates[hash % merge_candidate_count];
+        if (candidate.pass == merge_pass && candidate.hash == hash) {
+            Pagemap *other = candidate.pagemap;
+            if (other != pagemap && !other->lock.try_lock())
+                return; // the candidate stays for the next page with these contents
+            MappedRange *other_range;
+            u64 *other_entry = mergeable_entry(other, candidate.virt, &other_range);
+            bool merged = false;
+            if (other_entry && (*other_entry & phy_mask) != phy) {
+                uptr other_phy = *other_entry & phy_mask;
+                write_protect(pagemap, entry, virt);
+                write_protect(other, other_entry, candidate.virt);
+                if (klib::memcmp(data, (void*)(other_phy + hhdm), 0x1000) == 0) {
+                    // the candidate becomes the merged page and stays mapped where it is
+                    page_merge::insert(other_phy, hash);
+                    pmm::ref_page(other_phy);
+                    replace_page(pagemap, entry, virt, other_phy | shared_page_flags(range));
+                    page_merge::count_merge(false);
+                    merged = true;
+                }
+            }
+            if (other != pagemap)
+                other->lock.unlock();
+            if (merged) {
+                candidate.pass = 0;
+                return;
+            }
+        }
+        candidate = { pagemap, virt, hash, merge_pass };
+    }
+
+    // merges the next pages of the mergeable ranges of the pagemap, returns true when the scan reached the end,
+    // the lock must be held
+    static bool merge_from(Pagemap *pagemap) {
+        usize scanned = 0;
+        uptr virt = pagemap->merge_cursor;
+        MappedRange *range = pagemap->addr_to_range(virt);
+        if (range == nullptr)
+            range = range_at_or_above(pagemap, virt);
+        while (range && scanned < merge_scan_pages) {
+            uptr end = range->base + range->length;
+            if (range_mergeable(range)) {
+                virt = klib::max(virt, range->base);
+                while (virt < end && scanned < merge_scan_pages) {
+                    u64 *table = pagemap->pml4, *entry;
+                    usize level = 3;
+                    while (true) {
+                        entry = &table[(virt >> level_shift(level)) & 0x1FF];
+                        if (!(*entry & PAGE_PRESENT) || level == 0 || (*entry & PAGE_HUGE))
+                            break;
+                        table = (u64*)((*entry & phy_mask) + hhdm);
+                        level--;
+                    }
+                    uptr page = virt;
+                    virt = (virt & ~(level_page_size(level) - 1)) + level_page_size(level);
+                    if (!(*entry & PAGE_PRESENT) || level > 0) // huge pages are not merged
+                        continue;
+
+                    scanned++;
+                    if (page_mergeable(*entry))
+                        merge_page(pagemap, range, entry, page);
+                }
+                if (virt < end)
+                    break;
+            }
+            klib::AVLNode *next = pagemap->range_tree.next(&range->range_node);
+            range = next ? AVL_ENTRY(next, MappedRange, range_node) : nullptr;
+            virt = range ? range->base : 0;
+        }
+        pagemap->merge_cursor = range ? virt : 0;
+        return range == nullptr;
+    }
+
+    // pagemaps are never freed, so one can still be used after the list lock is dropped,
+    // reclaim reorders the list which at worst makes a pass skip or repeat a pagemap
+    static Pagemap* nth_user_pagemap(usize n) {
+        klib::LockGuard guard(user_pagemaps_lock);
+        if (n >= user_pagemap_count)
+            return nullptr;
+        klib::ListHead *node = user_pagemaps.next;
+        while (n--)
+            node = node->next;
+        return LIST_ENTRY(node, Pagemap, user_pagemaps);
+    }
+
+    [[noreturn]] void merge_thread() {
+        zero_page_hash = page_merge::hash_page((void*)(zero_page + hhdm));
+        while (true) {
+            // a pass scans every pagemap from start to end, a chunk per round so page faults get the lock in between
+            for (usize n = 0; Pagemap *pagemap = nth_user_pagemap(n); n++) {
+                bool done = false;
+                while (!done) {
+                    if (pagemap->lock.try_lock()) {
+                        done = merge_from(pagemap);
+                        pagemap->lock.unlock();
+                    }
+                    sched::yield();
+                }
+            }
+            page_merge::prune();
+            merge_pass++;
+            for (usize i = 0; i < merge_sleep_rounds; i++)
+                sched::yield();
+        }
+    }
 }
@@ -2,7 +2,10 @@
 
 #include <klib/types.hpp>
 #include <klib/lock.hpp>
+#include <klib/avltree.hpp>
 #include <klib/list.hpp>
+#include <klib/algorithm.hpp>
+#include <mem/slab.hpp>
 #include <limine.hpp>
 
 #define PAGE_PRESENT (1 << 0)
@@ -13,44 +16,116 @@
 #define PAGE_ACCESSED (1 << 5)
 #define PAGE_DIRTY (1 << 6)
 #define PAGE_ATTRIBUTE_TABLE (1 << 7)
+#define PAGE_HUGE (1 << 7) // only in PDPT and PD entries, maps a 1 GiB or 2 MiB page
 #define PAGE_GLOBAL (1 << 8)
+#define PAGE_COW (1 << 9) // ignored by the cpu, the page is shared read only and copied on the first write
+#define PAGE_SWAP (1 << 10) // ignored by the cpu, only in non present entries whose page is in the swap store, the handle is in the address bits
+#define PAGE_HUGE_ATTRIBUTE_TABLE (1 << 12) // where the PAT bit lives in huge page entries
 #define PAGE_WRITE_COMBINING (PAGE_ATTRIBUTE_TABLE | PAGE_CACHE_DISABLE)
 #define PAGE_NO_EXECUTE ((u64)1 << 63)
 
+// page fault error code bits
+#define PAGE_FAULT_PRESENT (1 << 0) // the fault was a protection violation, not a missing page
+#define PAGE_FAULT_WRITE (1 << 1)
+#define PAGE_FAULT_USER (1 << 2)
+#define PAGE_FAULT_RESERVED (1 << 3) // a reserved bit was set in an entry
+#define PAGE_FAULT_FETCH (1 << 4)
+
+namespace fs::vfs {
+    struct FileNode;
+}
+
 namespace mem::vmm {
+    constexpr usize kernel_heap_size = 1024 * 1024 * 1024;
+    constexpr uptr kernel_heap_base = ~(uptr)0 - kernel_heap_size - 0x1000 + 1;
+    constexpr uptr user_half_end = 0x800000000000;
+
     struct MappedRange {
         enum class Type {
             DIRECT,
-            ANONYMOUS
+            ANONYMOUS,
+            FILE // read from the file on the first touch, private to the pagemap
         };
 
-        klib::ListHead range_list;
+        klib::AVLNode range_node;
         uptr base;
         uptr length;
         u64 page_flags;
         Type type;
+        uptr subtree_end; // highest end address of any range in this range's subtree
+        fs::vfs::FileNode *file; // FILE only
+        usize file_offset; // FILE only, where base is in the file
+        usize file_size; // FILE only, bytes from base that come from the file, the rest reads as zeroes
+        bool mergeable = false; // ANONYMOUS only, identical pages may be merged into one shared page
+
+        // the ranges of a pagemap are kept in an interval tree ordered by base
+        struct TreeTraits {
+            static bool less(const klib::AVLNode *a, const klib::AVLNode *b) {
+                return (AVL_ENTRY(a, MappedRange, range_node))->base < (AVL_ENTRY(b, MappedRange, range_node))->base;
+            }
+
+            static void update(klib::AVLNode *node) {
+                MappedRange *range = AVL_ENTRY(node, MappedRange, range_node);
+                range->subtree_end = range->base + range->length;
+                if (node->left)
+                    range->subtree_end = klib::max(range->subtree_end, (AVL_ENTRY(node->left, MappedRange, range_node))->subtree_end);
+                if (node->right)
+                    range->subtree_end = klib::max(range->subtree_end, (AVL_ENTRY(node->right, MappedRange, range_node))->subtree_end);
+            }
+        };
+
+        SLAB_ALLOCATED(MappedRange)
     };
 
     struct Pagemap {
         u64 *pml4;
         klib::Spinlock lock;
-        klib::ListHead range_list_head;
+        u16 pcid = 0; // tags the tlb entries of this pagemap, 0 for the kernel pagemap
+        u64 pcid_generation = 0; // the pcid is only valid while this matches the global generation
+        u64 active_cpus = 0; // cpus that have this pagemap loaded and get shootdowns for it
+        u64 stale_cpus = 0; // cpus that must drop their entries of the pcid before loading it again
+        klib::AVLTree<MappedRange::TreeTraits> range_tree;
+        MappedRange *last_range = nullptr; // cached result of the last addr_to_range lookup
+        uptr fault_around_next = 0; // the page right after the last fault around window
+        usize fault_around_pages = 1; // size of the last fault around window
+        klib::ListHead user_pagemaps; // links every user pagemap for reclaim
+        uptr reclaim_cursor = 0; // where reclaim continues its scan
+        uptr merge_cursor = 0; // where merge_thread continues its scan
 
         void activate();
         uptr physical_addr(uptr virt);
 
-        void map_page(uptr phy, uptr virt, u64 flags);
-        void map_pages(uptr phy, uptr virt, usize size, u64 flags);
+        void map_page(uptr phy, uptr virt, u64 flags, usize page_size = 0x1000);
+        void map_pages(uptr phy, uptr virt, usize size, u64 flags); // uses huge pages wherever possible
         void map_kernel(); // for user pagemaps
+        void unmap_pages(uptr virt, usize size); // also drops a reference to every page, meant for anonymous memory
+        bool try_unmap_pages(uptr virt, usize size, usize *freed); // for reclaim, false if the lock is taken
 
+        void add_range(MappedRange *range);
         MappedRange* addr_to_range(uptr virt);
-        bool handle_page_fault(uptr virt);
+        bool handle_page_fault(uptr virt, u64 error);
+        bool resolve_page_fault(uptr virt, u64 error); // the lock must be held
+
+        Pagemap* fork(); // copy on write clone of the user half
     };
 
+    // upper limit of pages populated by one page fault in a range that is accessed sequentially, 1 disables fault around
+    extern usize fault_around_max_pages;
+
     void init(uptr hhdm_base, limine_memmap_response *memmap_res, limine_kernel_address_response *kernel_addr_res);
+    void init_cpu(); // loads the kernel pagemap and enables global pages and pcids on the calling cpu
+    void init_shootdown(); // needs the lapic
+    void print_tlb_stats();
 
     uptr get_hhdm();
     Pagemap* get_kernel_pagemap();
+    Pagemap* new_user_pagemap(); // empty apart from the kernel half
+
+    // scans the mergeable ranges of every user pagemap and merges pages whose contents are identical
+    [[noreturn]] void merge_thread();
 
     isize syscall_mmap(void *hint, usize length, int prot, int flags, int fd, usize offset);
+    isize syscall_munmap(void *addr, usize length);
+    isize syscall_mprotect(void *addr, usize length, int prot);
+    isize syscall_madvise(void *addr, usize length, int advice);
 }
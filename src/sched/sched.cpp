@@ -5,6 +5,8 @@
 #include <cpu/cpu.hpp>
 #include <cpu/gdt/gdt.hpp>
 #include <cpu/interrupts/interrupts.hpp>
+#include <cpu/interrupts/idt.hpp>
+#include <cpu/interrupts/apic.hpp>
 #include <cpu/syscall/syscall.hpp>
 #include <klib/cstring.hpp>
 #include <klib/cstdio.hpp>
@@ -13,7 +15,10 @@
 
 namespace sched {
     const usize stack_size = 64 * 1024; // 64 KiB
+    const usize syscall_frame_size = 17 * 8; // ds, es and the 15 registers pushed by __syscall_entry, laid out like the start of InterruptState
     static klib::ListHead sched_list_head;
+    static u8 yield_vector; // a self ipi to it runs the scheduler like the timer does
+    static constinit mem::SlabCache interrupt_state_cache("InterruptState", sizeof(cpu::InterruptState));
 
     int Task::allocate_fdnum() {
         num_file_descriptors++;
@@ -32,7 +37,8 @@ namespace sched {
     
     Task::Task() {
         tid = last_tid++;
-        gpr_state = new cpu::InterruptState();
+        gpr_state = (cpu::InterruptState*)interrupt_state_cache.alloc();
+        klib::memset(gpr_state, 0, sizeof(cpu::InterruptState));
         blocked = false;
         num_file_descriptors = 0;
         first_free_fdnum = 0;
@@ -63,24 +69,17 @@ namespace sched {
     Task* new_user_task(fs::vfs::FileNode *elf_file, bool enqueue) {
         Task *task = new Task();
 
-        task->pagemap = new mem::vmm::Pagemap();
-        task->pagemap->pml4 = (u64*)(mem::pmm::alloc_pages(1) + mem::vmm::get_hhdm());
-        klib::memset(task->pagemap->pml4, 0, 0x1000);
-        task->pagemap->map_kernel();
-        task->pagemap->range_list_head.init();
+        task->pagemap = mem::vmm::new_user_pagemap();
 
         uptr kernel_stack_phy = mem::pmm::alloc_pages(stack_size / 0x1000);
         task->kernel_stack = kernel_stack_phy + stack_size + mem::vmm::get_hhdm();
         
         uptr ip = userland::elf::load(task->pagemap, elf_file, &task->mmap_anon_base);
 
+        uptr stack_phy = mem::pmm::alloc_pages(stack_size / 0x1000, mem::pmm::ALLOC_ZEROED);
+        task->pagemap->map_pages(stack_phy, task->mmap_anon_base, stack_size, PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE | PAGE_NO_EXECUTE);
+        task->mmap_anon_base += stack_size;
         task->stack = task->mmap_anon_base;
-        for (usize i = 0; i < stack_size / 0x1000; i++) {
-            uptr page_phy = mem::pmm::alloc_pages(1);
-            klib::memset((void*)(page_phy + mem::vmm::get_hhdm()), 0, 0x1000);
-            task->pagemap->map_page(page_phy, task->mmap_anon_base, PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE | PAGE_NO_EXECUTE);
-            task->mmap_anon_base += 0x1000;
-        }
 
         task->running_on = 0;
         task->gpr_state->cs = u64(cpu::GDTSegment::USER_CODE_64) | 3;
@@ -106,6 +105,49 @@ namespace sched {
         return task;
     }
 
+    isize syscall_fork() {
+#if SYSCALL_TRACE
+        klib::printf("fork()\n");
+#endif
+        Task *parent = (Task*)cpu::read_gs_base();
+        Task *task = new Task();
+
+        task->pagemap = parent->pagemap->fork();
+
+        uptr kernel_stack_phy = mem::pmm::alloc_pages(stack_size / 0x1000);
+        task->kernel_stack = kernel_stack_phy + stack_size + mem::vmm::get_hhdm();
+
+        // the general purpose registers were pushed by the syscall entry at the top of the kernel stack
+        klib::memcpy(task->gpr_state, (void*)(parent->kernel_stack - syscall_frame_size), syscall_frame_size);
+        task->gpr_state->rax = 0; // fork returns 0 in the child
+        task->gpr_state->err = 0;
+        task->gpr_state->rip = task->gpr_state->rcx; // sysret takes the return address from rcx and rflags from r11
+        task->gpr_state->rflags = task->gpr_state->r11;
+        task->gpr_state->rsp = parent->user_stack;
+        task->gpr_state->cs = u64(cpu::GDTSegment::USER_CODE_64) | 3;
+        task->gpr_state->ss = u64(cpu::GDTSegment::USER_DATA_64) | 3;
+        task->gs_base = cpu::read_kernel_gs_base(); // swapped out by the syscall entry
+        task->fs_base = cpu::read_fs_base();
+        task->running_on = 0;
+        task->stack = parent->stack;
+        task->mmap_anon_base = parent->mmap_anon_base;
+
+        // the descriptors are copied, so the child gets its own cursors
+        for (usize i = 0; i < parent->file_descriptors.size(); i++) {
+            fs::vfs::FileDescriptor *descriptor = parent->file_descriptors[i];
+            task->file_descriptors.push_back(descriptor ? new fs::vfs::FileDescriptor(*descriptor) : nullptr);
+        }
+        task->num_file_descriptors = parent->num_file_descriptors;
+        task->first_free_fdnum = parent->first_free_fdnum;
+        task->cwd = parent->cwd;
+
+        {
+            klib::InterruptGuard guard;
+            sched_list_head.add_before(&task->sched_list);
+        }
+        return task->tid;
+    }
+
     [[noreturn]] static void test_task_1() {
         klib::printf("Hello from task 1!\n");
         auto fb = gfx::screen_fb();
@@ -150,6 +192,11 @@ namespace sched {
 
     void init() {
         sched_list_head.init();
+        yield_vector = cpu::interrupts::allocate_vector();
+        cpu::interrupts::load_idt_handler(yield_vector, scheduler_isr);
+        new_kernel_task(uptr(mem::pmm::zeroing_thread), true);
+        new_kernel_task(uptr(mem::pmm::reclaim_thread), true);
+        new_kernel_task(uptr(mem::vmm::merge_thread), true);
         new_kernel_task(uptr(test_task_1), true);
         new_kernel_task(uptr(test_task_2), true);
     }
@@ -168,6 +215,10 @@ namespace sched {
         while (true) asm("hlt");
     }
 
+    void yield() {
+        cpu::interrupts::LAPIC::send_ipi(cpu::lapic_id(cpu::current_cpu_number()), yield_vector);
+    }
+
     [[noreturn]] void syscall_exit(int status) {
 #if SYSCALL_TRACE
         klib::printf("exit(%d)\n", status);
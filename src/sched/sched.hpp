@@ -2,6 +2,7 @@
 
 #include <cpu/cpu.hpp>
 #include <mem/vmm.hpp>
+#include <mem/slab.hpp>
 #include <klib/types.hpp>
 #include <klib/vector.hpp>
 #include <klib/list.hpp>
@@ -26,10 +27,12 @@ namespace sched {
         usize num_file_descriptors; // the actual number
         usize first_free_fdnum; // used for allocating file descriptor numbers
         fs::vfs::DirectoryNode *cwd; // current working directory
-        uptr mmap_anon_base; // used for mmap bump allocator
+        uptr mmap_anon_base; // mmap hands out the free space above this
 
         Task();
         int allocate_fdnum();
+
+        SLAB_ALLOCATED(Task)
     };
 
     void init();
@@ -37,8 +40,10 @@ namespace sched {
     Task* new_kernel_task(uptr ip, bool enqueue);
     Task* new_user_task(fs::vfs::FileNode *elf_file, bool enqueue);
     [[noreturn]] void dequeue_and_die();
+    void yield(); // gives the rest of the time slice to the next task, for background kernel threads that are out of work
     
     [[noreturn]] void syscall_exit(int status);
+    isize syscall_fork();
     
     void scheduler_isr(u64 vec, cpu::InterruptState *gpr_state);
 }
@@ -3,10 +3,46 @@
 #include <klib/cstdio.hpp>
 #include <klib/algorithm.hpp>
 #include <mem/vmm.hpp>
-#include <mem/pmm.hpp>
 #include <panic.hpp>
 
 namespace userland::elf {
+    static void add_range(mem::vmm::Pagemap *pagemap, mem::vmm::MappedRange *range) {
+        if (range->length == 0) {
+            delete range;
+            return;
+        }
+        pagemap->add_range(range);
+    }
+
+    // segments whose ends share a page get a range of their own for it, mapped with the access of both,
+    // linkers give them the same file offset there so the page is just the file contents
+    // shrinks both ranges and returns the shared one, which comes before whatever is left of next
+    static mem::vmm::MappedRange* split_shared_pages(mem::vmm::MappedRange *previous, mem::vmm::MappedRange *next) {
+        usize shared_length = previous->base + previous->length - next->base;
+        if (previous->file_offset + (next->base - previous->base) != next->file_offset)
+            panic("ELF Loader: Segments sharing a page at different file offsets");
+
+        auto *shared = new mem::vmm::MappedRange();
+        shared->base = next->base;
+        shared->length = shared_length;
+        // writable or executable if either is
+        shared->page_flags = (previous->page_flags | next->page_flags) & ~(u64)PAGE_NO_EXECUTE;
+        shared->page_flags |= previous->page_flags & next->page_flags & PAGE_NO_EXECUTE;
+        shared->type = mem::vmm::MappedRange::Type::FILE;
+        shared->file = next->file;
+        shared->file_offset = next->file_offset;
+        usize previous_file_end = previous->file_size > next->base - previous->base ? previous->file_size - (next->base - previous->base) : 0;
+        shared->file_size = klib::min(klib::max(previous_file_end, next->file_size), shared_length);
+
+        previous->length -= shared_length;
+        previous->file_size = klib::min(previous->file_size, previous->length);
+        next->base += shared_length;
+        next->length -= shared_length;
+        next->file_offset += shared_length;
+        next->file_size = next->file_size > shared_length ? next->file_size - shared_length : 0;
+        return shared;
+    }
+
     uptr load(mem::vmm::Pagemap *pagemap, fs::vfs::FileNode *file, uptr *first_free_virt) {
         ASSERT(first_free_virt);
         *first_free_virt = 0;
@@ -25,6 +61,8 @@ namespace userland::elf {
         if (header.identifier[4] != 2 || header.identifier[5] != 1 || header.identifier[7] != 0 || header.arch != 62)
             panic("Unsupported ELF file");
 
+        // a range is only added once the next segment is known, it might have to give up its last page
+        mem::vmm::MappedRange *previous = nullptr;
         for (usize i = 0; i < header.ph_count; i++) {
             ProgramHeader ph {};
             file->fs->read(file->fs, file, &ph, sizeof(ProgramHeader), header.ph_table_offset + i * header.ph_entry_size);
@@ -41,30 +79,39 @@ namespace userland::elf {
 
                 usize misalign = ph.virt_addr & 0xFFF;
                 usize mem_page_count = (ph.mem_size + misalign + 0x1000 - 1) / 0x1000;
-                usize file_page_count = (ph.file_size + misalign + 0x1000 - 1) / 0x1000;
-                
-                for (usize i = 0; i < mem_page_count; i++) {
-                    uptr page_phy = mem::pmm::alloc_pages(1);
-                    uptr page_virt = ph.virt_addr + (i * 0x1000);
-                    pagemap->map_page(page_phy, page_virt, page_flags);
-                    uptr dst = page_phy + mem::vmm::get_hhdm();
-                    klib::memset((void*)dst, 0, 0x1000); // TODO: optimize this
-                    if (i < file_page_count) {
-                        uptr offset = ph.offset + (i * 0x1000);
-                        uptr size = 0x1000;
-                        if (i == 0) {
-                            dst += misalign;
-                            offset += misalign;
-                            size -= misalign;
-                        } else if (i == file_page_count - 1) {
-                            size = (ph.file_size + misalign) % 0x1000;
-                        }
-                        file->fs->read(file->fs, file, (void*)dst, size, offset);
-                    }
-                    if (page_virt >= *first_free_virt)
-                        *first_free_virt = page_virt + 0x1000;
+                uptr segment_virt = ph.virt_addr - misalign;
+                if (mem_page_count == 0)
+                    break;
+
+                uptr segment_end = segment_virt + mem_page_count * 0x1000;
+                if (segment_end > *first_free_virt)
+                    *first_free_virt = segment_end;
+
+                // nothing is read yet, the page fault handler reads every page on its first touch
+                // the bytes in front of the segment on its first page come from the file as well
+                auto *range = new mem::vmm::MappedRange();
+                range->base = segment_virt;
+                range->length = mem_page_count * 0x1000;
+                range->page_flags = page_flags;
+                range->type = mem::vmm::MappedRange::Type::FILE;
+                range->file = file;
+                range->file_offset = ph.offset - misalign;
+                range->file_size = misalign + ph.file_size;
+
+                if (previous && segment_virt < previous->base + previous->length) {
+                    if (segment_virt < previous->base || range->base + range->length < previous->base + previous->length)
+                        panic("ELF Loader: Overlapping or unsorted segments");
+                    auto *shared = split_shared_pages(previous, range);
+                    add_range(pagemap, previous);
+                    previous = shared;
                 }
-                
+                if (range->length == 0) { // the segment fit in the shared page, the next one might still share it
+                    delete range;
+                    continue;
+                }
+                if (previous)
+                    add_range(pagemap, previous);
+                previous = range;
                 break;
             }
             default:
@@ -72,6 +119,9 @@ namespace userland::elf {
             }
         }
 
+        if (previous)
+            add_range(pagemap, previous);
+
         *first_free_virt = klib::align_up<uptr, 0x1000>(*first_free_virt);
         return header.entry_addr;
     }
@@ -49,3 +49,19 @@ isize chdir(const char *path) {
 isize mmap(void *hint, usize length, int prot, int flags, int fd, usize offset) {
     return syscall(SYS_mmap, (uptr)hint, length, prot, flags, fd, offset);
 }
+
+isize fork() {
+    return syscall(SYS_fork);
+}
+
+isize munmap(void *addr, usize length) {
+    return syscall(SYS_munmap, (uptr)addr, length);
+}
+
+isize mprotect(void *addr, usize length, int prot) {
+    return syscall(SYS_mprotect, (uptr)addr, length, prot);
+}
+
+isize madvise(void *addr, usize length, int advice) {
+    return syscall(SYS_madvise, (uptr)addr, length, advice);
+}
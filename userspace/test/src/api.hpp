@@ -15,3 +15,7 @@ void seek(int fd, isize offset);
 isize getcwd(char *buf, usize size);
 isize chdir(const char *path);
 isize mmap(void *hint, usize length, int prot, int flags, int fd, usize offset);
+isize fork();
+isize munmap(void *addr, usize length);
+isize mprotect(void *addr, usize length, int prot);
+isize madvise(void *addr, usize length, int advice);
@@ -14,6 +14,10 @@
 #define SYS_getcwd 9
 #define SYS_chdir  10
 #define SYS_mmap   11
+#define SYS_fork   12
+#define SYS_munmap 13
+#define SYS_mprotect 14
+#define SYS_madvise 15
 
 #define SYSCALL_INLINE [[gnu::always_inline]] inline
 
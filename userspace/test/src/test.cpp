@@ -88,6 +88,7 @@ static void test_mmap() {
             }
         }
 
+        munmap(ptr, N * sizeof(int));
         printf("done\n");
     }
     {
@@ -113,8 +114,67 @@ static void test_mmap() {
             }
         }
 
+        munmap(ptr, 1024 * 1024 * 1024);
         printf("done\n");
     }
+    {
+        printf("mapping, unmapping and mapping again\n");
+        isize first = mmap(nullptr, 0x10000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+        munmap((void*)first, 0x10000);
+        isize second = mmap(nullptr, 0x10000, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+        printf("address reused: %s\n", first == second ? "yes" : "no");
+        mprotect((void*)second, 0x10000, PROT_READ | PROT_WRITE);
+        *(int*)second = 1;
+        munmap((void*)second, 0x10000);
+        printf("done\n");
+    }
+}
+
+static void test_merge() {
+    constexpr usize size = 64 * 0x1000;
+    printf("filling two mergeable areas with the same contents\n");
+    isize first = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+    isize second = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+    if (first < 0 || second < 0) {
+        printf("mmap fail\n");
+        return;
+    }
+    int *a = (int*)first, *b = (int*)second;
+    for (usize i = 0; i < size / sizeof(int); i++)
+        a[i] = b[i] = i % 1024;
+    madvise(a, size, MADV_MERGEABLE);
+    madvise(b, size, MADV_MERGEABLE);
+
+    printf("press enter once the pages had time to merge\n");
+    flush_print_buffer();
+    char c[16];
+    read(stdin, c, sizeof(c));
+
+    // writes have to unshare the pages again
+    for (usize i = 0; i < size / sizeof(int); i += 1024)
+        a[i] = -1;
+    for (usize i = 0; i < size / sizeof(int); i++) {
+        if (b[i] != int(i % 1024) || a[i] != (i % 1024 == 0 ? -1 : int(i % 1024))) {
+            printf("incorrect\n");
+            return;
+        }
+    }
+    munmap(a, size);
+    munmap(b, size);
+    printf("done\n");
+}
+
+static void test_fork() {
+    static int value = 1;
+    flush_print_buffer(); // the child would print the buffered text again
+    isize pid = fork();
+    if (pid == 0) {
+        value = 2;
+        printf("child: value is %d\n", value);
+        flush_print_buffer();
+        exit(0);
+    }
+    printf("parent: forked %ld, value is %d\n", pid, value);
 }
 
 int main() {
@@ -128,12 +188,14 @@ int main() {
         stdin_buffer[255] = 0;
         read(stdin, stdin_buffer, 255);
         char *input = (char*)stdin_buffer;
-        if (strcmp(input, "help\n") == 0)   { printf("exit\ncwd\nopenat\nfd\nmmap\n"); continue; }
+        if (strcmp(input, "help\n") == 0)   { printf("exit\ncwd\nopenat\nfd\nmmap\nfork\nmerge\n"); continue; }
         if (strcmp(input, "exit\n") == 0)   { printf("goodbye\n"); return 0; }
         if (strcmp(input, "cwd\n") == 0)    { test_cwd(); continue; }
         if (strcmp(input, "openat\n") == 0) { test_openat(); continue; }
         if (strcmp(input, "fd\n") == 0)     { test_fd(); continue; }
         if (strcmp(input, "mmap\n") == 0)   { test_mmap(); continue; }
+        if (strcmp(input, "fork\n") == 0)   { test_fork(); continue; }
+        if (strcmp(input, "merge\n") == 0)  { test_merge(); continue; }
         printf("invalid command\n");
     }
     return 0;